@@ -0,0 +1,16 @@
+#!/bin/bash
+#SBATCH --partition=batch
+#SBATCH --ntasks-per-node=2
+#SBATCH --ntasks-per-socket=1
+#SBATCH --cpus-per-task=24
+#SBATCH --nodes=1
+#SBATCH --time=2:00:00
+
+module load gcc openmpi
+
+mpicc mpi_a.c -o mpi_a.o helpers.c mpihelp.c options.c distance.c mapfile.c vptree.c profile.c rng.c stream.c smp.c hierarchy.c verify.c -lm -fopenmp
+
+export OMP_PLACES=cores
+export OMP_PROC_BIND=close
+
+for i in {1..10}; do srun --cpu-bind=sockets ./mpi_a.o --threads $SLURM_CPUS_PER_TASK; done
@@ -6,6 +6,6 @@
 
 module load gcc openmpi
 
-mpicc mpi_a.c -o mpi_a.o helpers.c mpihelp.c -lm
+mpicc mpi_a.c -o mpi_a.o helpers.c mpihelp.c options.c distance.c mapfile.c vptree.c profile.c rng.c stream.c smp.c hierarchy.c verify.c -lm -fopenmp
 
 for i in {1..10}; do srun ./mpi_a.o; done
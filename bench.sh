@@ -0,0 +1,69 @@
+#!/bin/bash
+# Benchmark driver: generates a synthetic dataset with generate.o, runs mpi_a.o
+# RUNS times for every rank count of RANKS with fixed seeds, and writes the median
+# and the 10th and 90th percentile of every phase of --profile, over the runs, to OUT.
+# Every setting is an environment variable, e.g.
+#   N=1000000 DIMS=128 DIST=clustered RANKS="2 4 8 16" RUNS=10 ./bench.sh
+# With WEAK=1, N is the points per process and the dataset grows with the ranks.
+
+N=${N:-100000}
+DIMS=${DIMS:-64}
+DIST=${DIST:-uniform}
+CLUSTERS=${CLUSTERS:-16}
+SPREAD=${SPREAD:-0.05}
+DUPLICATES=${DUPLICATES:-0}
+SEED=${SEED:-1}
+RANKS=${RANKS:-"2 4 8 16"}
+RUNS=${RUNS:-5}
+WEAK=${WEAK:-0}
+ARGS=${ARGS:-}
+MPIEXEC=${MPIEXEC:-mpiexec}
+MPIFLAGS=${MPIFLAGS:-}
+OUT=${OUT:-bench/results.csv}
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+WORK=$(dirname "$OUT")/work
+mkdir -p "$WORK"
+
+if [ ! -f "$OUT" ]; then
+    echo "n,dims,dist,clusters,spread,duplicates,seed,weak,args,processes,runs,metric,median,p10,p90" > "$OUT"
+fi
+
+# The value at the given percentile of the numbers on stdin, by nearest rank.
+percentile() {
+    sort -g | awk -v q="$1" '{ v[NR] = $1 } END { i = int(q * NR + 0.999999); if (i < 1) i = 1; print v[i] }'
+}
+
+for np in $RANKS; do
+    points=$N
+    if [ "$WEAK" = "1" ]; then
+        points=$((N * np))
+    fi
+
+    data="$WORK/n${points}_d${DIMS}_${DIST}_c${CLUSTERS}_dup${DUPLICATES}_s${SEED}.bin"
+    if [ ! -f "$data" ]; then
+        "$ROOT/generate.o" --n "$points" --dims "$DIMS" --dist "$DIST" --clusters "$CLUSTERS" \
+            --spread "$SPREAD" --duplicates "$DUPLICATES" --seed "$SEED" --out "$data" || exit 1
+    fi
+
+    rm -f "$WORK"/profile_*.csv
+    for run in $(seq "$RUNS"); do
+        # Every run has a seed of its own, the same one every time the driver is run.
+        (cd "$WORK" && $MPIEXEC $MPIFLAGS -np "$np" "$ROOT/mpi_a.o" --data "$data" --seed $((SEED + run)) \
+            --profile "profile_$run.csv" $ARGS > "run_$run.log") || exit 1
+        if grep -q "ERROR" "$WORK/run_$run.log"; then
+            echo "Run $run on $np processes failed the self check."
+            exit 1
+        fi
+    done
+
+    # The slowest process of every run is the time of the run.
+    for metric in io distance select partition exchange split wait total; do
+        values=$(grep -h "^$metric," "$WORK"/profile_*.csv | cut -d, -f5)
+        median=$(echo "$values" | percentile 0.5)
+        p10=$(echo "$values" | percentile 0.1)
+        p90=$(echo "$values" | percentile 0.9)
+        echo "$points,$DIMS,$DIST,$CLUSTERS,$SPREAD,$DUPLICATES,$SEED,$WEAK,$ARGS,$np,$RUNS,$metric,$median,$p10,$p90" >> "$OUT"
+    done
+    echo "$np processes: median total $(grep -h '^total,' "$WORK"/profile_*.csv | cut -d, -f5 | percentile 0.5) seconds"
+done
@@ -0,0 +1,565 @@
+/**
+ * @file: distance.c
+ * ********************
+ * @description: Squared euclidean distances of a batch of points from a pivot.
+ * Points are stored one after the other, each one taking dims floats.
+ * There are AVX-512 and AVX2 versions of the kernel, as well as a scalar
+ * fallback, and the best one is selected once, on the first call.
+ * Compact points, uint8 or fp16, have kernels of their own, which accumulate
+ * in int32 and float32 respectively.
+ * Points may also be blocked in tiles of DISTANCE_TILE: the first coordinate of
+ * every point of the tile, then the second one and so on. The tile kernels load
+ * every coordinate of the pivot once per tile and keep a distance in every lane.
+ * They add the squares up in the same order as the row kernel of their instruction
+ * set, so a point has the same distance in a tile and in a row.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DISTANCE_X86
+#endif
+
+#include "headers/distance.h"
+
+
+// The distance of a single point from the pivot.
+typedef float (*row_kernel)(const float *a, const float *b, long dims);
+typedef float (*u8_kernel)(const unsigned char *a, const unsigned char *b, long dims);
+typedef float (*f16_kernel)(const unsigned short *a, const unsigned short *b, long dims);
+// The distances of the DISTANCE_TILE points of a tile from the pivot.
+typedef void (*tile_kernel)(const float *tile, const float *pivot, long dims, float *out);
+
+
+// IEEE half precision to single precision, subnormals included.
+float halfToFloat(unsigned short h) {
+	unsigned int sign = (h & 0x8000u) << 16;
+	unsigned int exp = (h >> 10) & 0x1F;
+	unsigned int mant = h & 0x3FF;
+	unsigned int bits;
+
+	if (exp == 0 && mant == 0) {
+		bits = sign;
+	} else if (exp == 0) {
+		// Normalize the subnormal.
+		exp = 113;
+		while (!(mant & 0x400)) {
+			mant <<= 1;
+			exp--;
+		}
+		bits = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+	} else if (exp == 31) {
+		bits = sign | 0x7F800000u | (mant << 13);
+	} else {
+		bits = sign | ((exp + 112) << 23) | (mant << 13);
+	}
+
+	float f;
+	memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+
+// Single precision to half precision, rounding to the nearest even.
+unsigned short floatToHalf(float f) {
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(float));
+	unsigned int sign = (bits >> 16) & 0x8000u;
+	int exp = (int) ((bits >> 23) & 0xFF) - 127 + 15;
+	unsigned int mant = bits & 0x7FFFFF;
+
+	if (((bits >> 23) & 0xFF) == 0xFF) {
+		return sign | 0x7C00 | (mant ? 0x200 : 0);
+	}
+	if (exp >= 31) {
+		return sign | 0x7C00;
+	}
+
+	unsigned int half, rem, mid;
+	if (exp <= 0) {
+		if (exp < -10) {
+			return sign;
+		}
+		// Subnormal, the implicit bit becomes part of the mantissa.
+		mant |= 0x800000;
+		int shift = 14 - exp;
+		half = mant >> shift;
+		rem = mant & ((1u << shift) - 1);
+		mid = 1u << (shift - 1);
+	} else {
+		half = ((unsigned int) exp << 10) | (mant >> 13);
+		rem = mant & 0x1FFF;
+		mid = 0x1000;
+	}
+
+	// A carry out of the mantissa correctly bumps the exponent.
+	if (rem > mid || (rem == mid && (half & 1))) {
+		half++;
+	}
+
+	return sign | half;
+}
+
+
+static float squaredScalar(const float *a, const float *b, long dims) {
+	float distance = 0;
+	for (long i = 0; i < dims; i++) {
+		float diff = a[i] - b[i];
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+
+static void squaredTileScalar(const float *tile, const float *pivot, long dims, float *out) {
+	float distance[DISTANCE_TILE] = {0};
+	for (long j = 0; j < dims; j++) {
+		for (int l = 0; l < DISTANCE_TILE; l++) {
+			float diff = tile[j * DISTANCE_TILE + l] - pivot[j];
+			distance[l] += diff * diff;
+		}
+	}
+
+	memcpy(out, distance, DISTANCE_TILE * sizeof(float));
+}
+
+
+static float squaredU8Scalar(const unsigned char *a, const unsigned char *b, long dims) {
+	int distance = 0;
+	for (long i = 0; i < dims; i++) {
+		int diff = a[i] - b[i];
+		distance += diff * diff;
+	}
+
+	return (float) distance;
+}
+
+
+static float squaredF16Scalar(const unsigned short *a, const unsigned short *b, long dims) {
+	float distance = 0;
+	for (long i = 0; i < dims; i++) {
+		float diff = halfToFloat(a[i]) - halfToFloat(b[i]);
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+
+#ifdef DISTANCE_X86
+
+// Widens 16 bytes to 16-bit lanes and lets madd square and pair them up in int32.
+__attribute__((target("avx2")))
+static float squaredU8AVX2(const unsigned char *a, const unsigned char *b, long dims) {
+	__m256i acc = _mm256_setzero_si256();
+	long i = 0;
+
+	for (; i + 16 <= dims; i += 16) {
+		__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (a + i)));
+		__m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (b + i)));
+		__m256i d = _mm256_sub_epi16(x, y);
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+	}
+
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+	int distance = _mm_cvtsi128_si32(sum);
+
+	for (; i < dims; i++) {
+		int diff = a[i] - b[i];
+		distance += diff * diff;
+	}
+
+	return (float) distance;
+}
+
+
+__attribute__((target("avx2,fma,f16c")))
+static float squaredF16AVX2(const unsigned short *a, const unsigned short *b, long dims) {
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	long i = 0;
+
+	for (; i + 16 <= dims; i += 16) {
+		__m256 d0 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (a + i))),
+			_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (b + i))));
+		__m256 d1 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (a + i + 8))),
+			_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (b + i + 8))));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+	}
+	for (; i + 8 <= dims; i += 8) {
+		__m256 d0 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (a + i))),
+			_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (b + i))));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+	}
+
+	__m256 acc = _mm256_add_ps(acc0, acc1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	float distance = _mm_cvtss_f32(sum);
+
+	for (; i < dims; i++) {
+		float diff = halfToFloat(a[i]) - halfToFloat(b[i]);
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+
+__attribute__((target("avx2,fma")))
+static float squaredAVX2(const float *a, const float *b, long dims) {
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	long i = 0;
+
+	// Two accumulators to hide the latency of the fused multiply-adds.
+	for (; i + 16 <= dims; i += 16) {
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+	}
+	for (; i + 8 <= dims; i += 8) {
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+	}
+
+	// Horizontal sum of the 8 lanes.
+	__m256 acc = _mm256_add_ps(acc0, acc1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	float distance = _mm_cvtss_f32(sum);
+
+	// The dimensions that did not fill a whole register. Fused, whether or not the
+	// compiler would contract the sum, so that squaredTileAVX2 rounds them alike.
+	for (; i < dims; i++) {
+		float diff = a[i] - b[i];
+		distance = fmaf(diff, diff, distance);
+	}
+
+	return distance;
+}
+
+
+/**
+ * The 16 distances of squaredAVX2, rounded the same way. Every lane of the row kernel
+ * sums the coordinates of a residue modulo 16, up to the last whole 8 of them, so each
+ * residue gets two registers here, for the first and the last 8 points of the tile,
+ * four residues at a time. They are then added up in the order of the row kernel's
+ * horizontal sum, and the remaining coordinates one at a time.
+ */
+__attribute__((target("avx2,fma")))
+static void squaredTileAVX2(const float *tile, const float *pivot, long dims, float *out) {
+	long whole = dims / 8 * 8;
+	__m256 residue[2][16];
+
+	for (int g = 0; g < 16; g += 4) {
+		__m256 lo[4], hi[4];
+		for (int r = 0; r < 4; r++) {
+			lo[r] = _mm256_setzero_ps();
+			hi[r] = _mm256_setzero_ps();
+		}
+		for (long j = g; j < whole; j += 16) {
+			for (int r = 0; r < 4 && j + r < whole; r++) {
+				const float *row = tile + (j + r) * DISTANCE_TILE;
+				__m256 p = _mm256_broadcast_ss(pivot + j + r);
+				__m256 dl = _mm256_sub_ps(_mm256_loadu_ps(row), p);
+				__m256 dh = _mm256_sub_ps(_mm256_loadu_ps(row + 8), p);
+				lo[r] = _mm256_fmadd_ps(dl, dl, lo[r]);
+				hi[r] = _mm256_fmadd_ps(dh, dh, hi[r]);
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			residue[0][g + r] = lo[r];
+			residue[1][g + r] = hi[r];
+		}
+	}
+
+	for (int h = 0; h < 2; h++) {
+		__m256 *s = residue[h];
+		__m256 a[8];
+		for (int k = 0; k < 8; k++) {
+			a[k] = _mm256_add_ps(s[k], s[k + 8]);
+		}
+		__m256 b[4];
+		for (int k = 0; k < 4; k++) {
+			b[k] = _mm256_add_ps(a[k], a[k + 4]);
+		}
+		__m256 distance = _mm256_add_ps(_mm256_add_ps(b[0], b[2]), _mm256_add_ps(b[1], b[3]));
+
+		for (long j = whole; j < dims; j++) {
+			__m256 d = _mm256_sub_ps(_mm256_loadu_ps(tile + j * DISTANCE_TILE + 8 * h), _mm256_broadcast_ss(pivot + j));
+			distance = _mm256_fmadd_ps(d, d, distance);
+		}
+		_mm256_storeu_ps(out + 8 * h, distance);
+	}
+}
+
+
+/**
+ * The 16 distances of squaredAVX512, rounded the same way. Its two accumulators sum
+ * the coordinates of a residue modulo 32 in every lane, up to the last whole 32 of
+ * them, and the first one then the rest modulo 16. Each residue gets a register here,
+ * eight residues at a time, and they are added up in the order of the row kernel.
+ */
+__attribute__((target("avx512f")))
+static void squaredTileAVX512(const float *tile, const float *pivot, long dims, float *out) {
+	long whole = dims / 32 * 32;
+	__m512 residue[32];
+
+	for (int g = 0; g < 32; g += 8) {
+		__m512 acc[8];
+		for (int r = 0; r < 8; r++) {
+			acc[r] = _mm512_setzero_ps();
+		}
+		for (long j = g; j < whole; j += 32) {
+			for (int r = 0; r < 8; r++) {
+				__m512 d = _mm512_sub_ps(_mm512_loadu_ps(tile + (j + r) * DISTANCE_TILE), _mm512_set1_ps(pivot[j + r]));
+				acc[r] = _mm512_fmadd_ps(d, d, acc[r]);
+			}
+		}
+		// The masked tail of the row kernel only goes to its first accumulator.
+		for (long j = whole + g; g < 16 && j < dims; j += 16) {
+			for (int r = 0; r < 8 && j + r < dims; r++) {
+				__m512 d = _mm512_sub_ps(_mm512_loadu_ps(tile + (j + r) * DISTANCE_TILE), _mm512_set1_ps(pivot[j + r]));
+				acc[r] = _mm512_fmadd_ps(d, d, acc[r]);
+			}
+		}
+		for (int r = 0; r < 8; r++) {
+			residue[g + r] = acc[r];
+		}
+	}
+
+	__m512 a[16];
+	for (int k = 0; k < 16; k++) {
+		a[k] = _mm512_add_ps(residue[k], residue[k + 16]);
+	}
+	for (int k = 0; k < 8; k++) {
+		a[k] = _mm512_add_ps(a[k], a[k + 8]);
+	}
+	for (int k = 0; k < 4; k++) {
+		a[k] = _mm512_add_ps(a[k], a[k + 4]);
+	}
+	_mm512_storeu_ps(out, _mm512_add_ps(_mm512_add_ps(a[0], a[2]), _mm512_add_ps(a[1], a[3])));
+}
+
+
+__attribute__((target("avx512f")))
+static float squaredAVX512(const float *a, const float *b, long dims) {
+	__m512 acc0 = _mm512_setzero_ps();
+	__m512 acc1 = _mm512_setzero_ps();
+	long i = 0;
+
+	for (; i + 32 <= dims; i += 32) {
+		__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		__m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+		acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+	}
+
+	// Masked loads take care of the tail, 784 is not a multiple of 32.
+	for (; i < dims; i += 16) {
+		long left = dims - i;
+		__mmask16 mask = (left >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1u << left) - 1);
+		__m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+		acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+	}
+
+	// The lanes are added in halves, in a fixed order that squaredTileAVX512 follows too.
+	__m512 acc = _mm512_add_ps(acc0, acc1);
+	__m256 half = _mm256_add_ps(_mm512_castps512_ps256(acc),
+		_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(acc), 1)));
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(half), _mm256_extractf128_ps(half, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+	return _mm_cvtss_f32(sum);
+}
+
+#endif
+
+
+static row_kernel kernel = NULL;
+static u8_kernel kernelU8 = NULL;
+static f16_kernel kernelF16 = NULL;
+static tile_kernel kernelTile = NULL;
+static const char *kernelName = "scalar";
+
+
+// Picks the widest kernel the CPU can run.
+static void selectKernel() {
+	kernel = squaredScalar;
+	kernelU8 = squaredU8Scalar;
+	kernelF16 = squaredF16Scalar;
+	kernelTile = squaredTileScalar;
+	kernelName = "scalar";
+
+#ifdef DISTANCE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		kernel = squaredAVX512;
+		kernelTile = squaredTileAVX512;
+		kernelName = "avx512";
+	} else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		kernel = squaredAVX2;
+		kernelTile = squaredTileAVX2;
+		kernelName = "avx2";
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		kernelU8 = squaredU8AVX2;
+		if (__builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+			kernelF16 = squaredF16AVX2;
+		}
+	}
+#endif
+}
+
+
+// Name of the kernel in use, for the logs.
+const char *distanceKernelName() {
+	if (kernel == NULL) {
+		selectKernel();
+	}
+
+	return kernelName;
+}
+
+
+// Squared distance of a single point, for callers that can't batch their points.
+float distanceSquared(const float *a, const float *b, long dims) {
+	if (kernel == NULL) {
+		selectKernel();
+	}
+
+	return kernel(a, b, dims);
+}
+
+
+/**
+ * Calculates the squared distance of each of the n points from the pivot.
+ * @param out: n floats, out[i] is the distance of the i-th point.
+ */ 
+void distancesBatch(const float *points, long n, long dims, const float *pivot, float *out) {
+	distancesBatchStrided(points, n, dims, dims, pivot, out);
+}
+
+
+// Same as distancesBatch, for points of dims floats stored stride floats apart.
+void distancesBatchStrided(const float *points, long n, long stride, long dims, const float *pivot, float *out) {
+	// Select before entering the parallel region, so threads never race on it.
+	if (kernel == NULL) {
+		selectKernel();
+	}
+	row_kernel k = kernel;
+
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < n; i++) {
+		out[i] = k(points + i * stride, pivot, dims);
+	}
+}
+
+
+/**
+ * Same as distancesBatch, for points of dims bytes stored stride bytes apart.
+ * The int32 sums are multiplied by scale2, the square of the dataset's scale.
+ */
+void distancesBatchU8(const unsigned char *points, long n, long stride, long dims,
+	const unsigned char *pivot, float scale2, float *out)
+{
+	if (kernel == NULL) {
+		selectKernel();
+	}
+	u8_kernel k = kernelU8;
+
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < n; i++) {
+		out[i] = k(points + i * stride, pivot, dims) * scale2;
+	}
+}
+
+
+// Same as distancesBatchU8, for half precision values stored stride halves apart.
+void distancesBatchF16(const unsigned short *points, long n, long stride, long dims,
+	const unsigned short *pivot, float scale2, float *out)
+{
+	if (kernel == NULL) {
+		selectKernel();
+	}
+	f16_kernel k = kernelF16;
+
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < n; i++) {
+		out[i] = k(points + i * stride, pivot, dims) * scale2;
+	}
+}
+
+
+// Floats of n points in tiles, the last tile padded to DISTANCE_TILE points.
+long tiledFloats(long n, long dims) {
+	return (n + DISTANCE_TILE - 1) / DISTANCE_TILE * DISTANCE_TILE * dims;
+}
+
+
+/**
+ * Copies n points, stored one after the other, to tiles of DISTANCE_TILE points.
+ * @param tiles: tiledFloats(n, dims) floats. The padding of the last tile is zeroed.
+ */
+void tilePoints(const float *rows, long n, long dims, float *tiles) {
+	long count = (n + DISTANCE_TILE - 1) / DISTANCE_TILE;
+
+	#pragma omp parallel for schedule(static)
+	for (long b = 0; b < count; b++) {
+		const float *first = rows + b * DISTANCE_TILE * dims;
+		float *tile = tiles + b * DISTANCE_TILE * dims;
+		int lanes = (n - b * DISTANCE_TILE < DISTANCE_TILE) ? n - b * DISTANCE_TILE : DISTANCE_TILE;
+
+		// Every row of the tile is written in one go, the points are read side by side.
+		for (long j = 0; j < dims; j++) {
+			for (int l = 0; l < DISTANCE_TILE; l++) {
+				tile[j * DISTANCE_TILE + l] = (l < lanes) ? first[l * dims + j] : 0;
+			}
+		}
+	}
+}
+
+
+// Copies point i out of the tiles, to dims floats at out.
+void untilePoint(const float *tiles, long i, long dims, float *out) {
+	const float *lane = tiles + i / DISTANCE_TILE * DISTANCE_TILE * dims + i % DISTANCE_TILE;
+	for (long j = 0; j < dims; j++) {
+		out[j] = lane[j * DISTANCE_TILE];
+	}
+}
+
+
+// Same as distancesBatch, for n points stored in tiles by tilePoints.
+void distancesTiled(const float *tiles, long n, long dims, const float *pivot, float *out) {
+	if (kernel == NULL) {
+		selectKernel();
+	}
+	tile_kernel k = kernelTile;
+	long count = (n + DISTANCE_TILE - 1) / DISTANCE_TILE;
+
+	#pragma omp parallel for schedule(static)
+	for (long b = 0; b < count; b++) {
+		long first = b * DISTANCE_TILE;
+		if (n - first >= DISTANCE_TILE) {
+			k(tiles + first * dims, pivot, dims, &out[first]);
+		} else {
+			// The padding of the last tile has distances too, which nobody asked for.
+			float lanes[DISTANCE_TILE];
+			k(tiles + first * dims, pivot, dims, lanes);
+			memcpy(&out[first], lanes, (n - first) * sizeof(float));
+		}
+	}
+}
@@ -0,0 +1,149 @@
+/**
+ * @file: generate.c
+ * ********************
+ * @description: Writes a synthetic dataset in the format of data/binmake.jl:
+ * long dims, long N, then every point's floats. Every point is drawn from its own
+ * stream, seeded by the seed and its index, so the same arguments always give the
+ * same file and a duplicate is found again by regenerating the point it copies.
+ * Usage: ./generate.o [--n <N>] [--dims <d>] [--dist uniform|normal|clustered]
+ *      [--clusters <k>] [--spread <s>] [--duplicates <ratio>] [--seed <s>] [--out <file>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "headers/rng.h"
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_NORMAL,
+    DIST_CLUSTERED
+} distribution;
+
+typedef struct {
+    long n;
+    long dims;
+    distribution dist;
+    // Centers of the clustered distribution and their standard deviation.
+    long clusters;
+    float spread;
+    // The share of the points that copy one of the points before them.
+    double duplicates;
+    uint64_t seed;
+    char *out;
+
+    float *centers;
+} generator;
+
+
+// The stream of point i, independent of every other point's.
+static void pointStream(generator *g, long i, rng *r) {
+    rng_seed(r, g->seed ^ ((uint64_t) i * 0xD1B54A32D192ED03ULL));
+    rng_next(r);
+}
+
+
+// Writes point i to out.
+static void generatePoint(generator *g, long i, float *out) {
+    rng r;
+    pointStream(g, i, &r);
+
+    // A duplicate is the point it copies, which may be a duplicate itself.
+    while (i > 0 && rng_uniform(&r) < g->duplicates) {
+        i = rng_below(&r, i);
+        pointStream(g, i, &r);
+    }
+
+    if (g->dist == DIST_UNIFORM) {
+        for (long j = 0; j < g->dims; j++) {
+            out[j] = (float) rng_uniform(&r);
+        }
+    } else if (g->dist == DIST_NORMAL) {
+        for (long j = 0; j < g->dims; j++) {
+            out[j] = (float) rng_normal(&r);
+        }
+    } else {
+        float *center = &g->centers[rng_below(&r, g->clusters) * g->dims];
+        for (long j = 0; j < g->dims; j++) {
+            out[j] = center[j] + g->spread * (float) rng_normal(&r);
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    generator g = {100000, 64, DIST_UNIFORM, 16, 0.05f, 0, 1, "data/synthetic.bin", NULL};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--n") == 0 && i + 1 < argc) {
+            g.n = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--dims") == 0 && i + 1 < argc) {
+            g.dims = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--dist") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "uniform") == 0) {
+                g.dist = DIST_UNIFORM;
+            } else if (strcmp(argv[i], "normal") == 0) {
+                g.dist = DIST_NORMAL;
+            } else if (strcmp(argv[i], "clustered") == 0) {
+                g.dist = DIST_CLUSTERED;
+            } else {
+                printf("Unknown distribution '%s', using uniform.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--clusters") == 0 && i + 1 < argc) {
+            g.clusters = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--spread") == 0 && i + 1 < argc) {
+            g.spread = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--duplicates") == 0 && i + 1 < argc) {
+            g.duplicates = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            g.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            g.out = argv[++i];
+        } else {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (g.n < 1 || g.dims < 1 || g.clusters < 1 || g.duplicates < 0 || g.duplicates >= 1) {
+        printf("Need n, dims and clusters of at least 1 and a duplicate ratio in [0, 1).\n");
+        return 1;
+    }
+
+    // The centers come from a stream of their own, so they don't depend on n.
+    g.centers = (float *) malloc(g.clusters * g.dims * sizeof(float));
+    rng r;
+    rng_seed(&r, ~g.seed);
+    for (long i = 0; i < g.clusters * g.dims; i++) {
+        g.centers[i] = (float) rng_uniform(&r);
+    }
+
+    FILE *file = fopen(g.out, "wb");
+    if (file == NULL) {
+        printf("Could not open %s.\n", g.out);
+        return 1;
+    }
+    fwrite(&g.dims, sizeof(long), 1, file);
+    fwrite(&g.n, sizeof(long), 1, file);
+
+    // Written in blocks of points, to keep the memory flat whatever n is.
+    long blockPoints = 4096;
+    float *block = (float *) malloc(blockPoints * g.dims * sizeof(float));
+    for (long start = 0; start < g.n; start += blockPoints) {
+        long count = (g.n - start < blockPoints) ? g.n - start : blockPoints;
+        for (long i = 0; i < count; i++) {
+            generatePoint(&g, start + i, &block[i * g.dims]);
+        }
+        fwrite(block, sizeof(float), count * g.dims, file);
+    }
+    fclose(file);
+
+    printf("Wrote %ld points of %ld dimensions to %s\n", g.n, g.dims, g.out);
+
+    free(block);
+    free(g.centers);
+    return 0;
+}
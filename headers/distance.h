@@ -0,0 +1,30 @@
+/**
+ * @file: distance.h
+ * ********************
+ * @description: Batched squared euclidean distance kernels. The widest SIMD
+ * version the CPU supports is picked at run time, the outer loop over the
+ * points is split between OpenMP threads.
+ */ 
+
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+// Points of a tile of the blocked layout, as many as the floats of an AVX-512 register.
+#define DISTANCE_TILE 16
+
+void distancesBatch(const float *points, long n, long dims, const float *pivot, float *out);
+void distancesBatchStrided(const float *points, long n, long stride, long dims, const float *pivot, float *out);
+float distanceSquared(const float *a, const float *b, long dims);
+void distancesBatchU8(const unsigned char *points, long n, long stride, long dims,
+    const unsigned char *pivot, float scale2, float *out);
+void distancesBatchF16(const unsigned short *points, long n, long stride, long dims,
+    const unsigned short *pivot, float scale2, float *out);
+long tiledFloats(long n, long dims);
+void tilePoints(const float *rows, long n, long dims, float *tiles);
+void untilePoint(const float *tiles, long i, long dims, float *out);
+void distancesTiled(const float *tiles, long n, long dims, const float *pivot, float *out);
+float halfToFloat(unsigned short h);
+unsigned short floatToHalf(float f);
+const char *distanceKernelName();
+
+#endif
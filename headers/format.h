@@ -0,0 +1,29 @@
+/**
+ * @file: format.h
+ * ********************
+ * @description: How the points are stored in memory and traded between processes.
+ * Compact points keep every coordinate as (x - offset) / scale, in a uint8 or an
+ * fp16, and are padded to whole floats. Every function that only moves points
+ * treats them as p->dims floats, whatever they hold.
+ */ 
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdbool.h>
+
+#include "options.h"
+
+typedef struct {
+    format_mode mode;
+    // Coordinates of every point, p->dims is how many floats they take up.
+    long features;
+    // The same for the whole dataset, found once the points are loaded.
+    float scale;
+    float offset;
+    // The float points are in the tiles of ws->tiles too, for the first distances.
+    // The first partition moves them from there to their place and drops the tiles.
+    bool tiled;
+} point_format;
+
+#endif
@@ -1,15 +1,23 @@
 #ifndef HELPERS_H
 #define HELPERS_H
 
-int maxPower(int num, int base, int rep);
+#include <stdint.h>
 
-float calculateDistanceArray(float *p, int start, float *ref, uint dims);
+int maxPower(int num, int base, int rep);
 
-uint partition(float *arr, uint low, uint high);
-float kthSmallest(float *array, uint start, uint end, uint k);
-float quickselect(float *distances, uint end);
+long partition(float *arr, long left, long right, long pIndex);
+float kthSmallest(float *array, long left, long right, long k);
+float quickselect(float *distances, long end);
+float splitValue(float *distances, long n, long k);
+float parallelSelect(float *a, long n, long k, float *scratch, float *next);
+float parallelSplitValue(float *distances, long n, long k, float *scratch);
+void seedSelection(uint64_t seed);
+long selectionRandom(long n);
+void rankChunk(long total, int parts, int index, long *count, long *offset);
+void partition3(float *arr, long left, long right, float value, long *lt, long *gt);
 
-void swapFloat(float *array, uint x, uint y, long len);
-void swapInt(int *array, uint x, uint y, long len);
+void swapFloat(float *array, long x, long y, long len);
+void swapInt(int *array, long x, long y, long len);
+void permuteChunks(float *array, long *perm, long n, long len, float *temp);
 
 #endif
\ No newline at end of file
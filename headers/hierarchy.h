@@ -0,0 +1,37 @@
+/**
+ * @file: hierarchy.h
+ * ********************
+ * @description: Two-level mode. The points of every node are pooled in the shared
+ * window of --load mmap, only the node leaders run the distributed recursion, each
+ * on the points of its whole node, and every leader then splits its node's points
+ * between the node's processes with the threads of the shared-memory engine.
+ */ 
+
+#ifndef HIERARCHY_H
+#define HIERARCHY_H
+
+#include <mpi.h>
+
+#include "process.h"
+#include "shared.h"
+
+typedef struct {
+    // The node leaders, MPI_COMM_NULL on the rest of the processes.
+    MPI_Comm leaders;
+    // The points of the node and their distances, both in windows shared by the node.
+    float *points;
+    float *distances;
+    MPI_Win distWin;
+    long nodePoints;
+
+    // On the leaders, a process that holds the whole node, with options and buffers of its own.
+    options opt;
+    workspace ws;
+    process leader;
+} hierarchy;
+
+void hierarchy_init(hierarchy *h, process *p, shared_points *sh);
+float *hierarchy_distribute(hierarchy *h, process *p, shared_points *sh);
+void hierarchy_free(hierarchy *h, shared_points *sh);
+
+#endif
@@ -0,0 +1,22 @@
+/**
+ * @file: mapfile.h
+ * ********************
+ * @description: Maps a binary file written by data/binmake.jl to memory,
+ * instead of reading it into a freshly allocated array.
+ */ 
+
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h>
+
+typedef struct {
+    void *base;
+    size_t length;
+} mapped_file;
+
+float *map_points(char *filename, long *dims, long *pointsTotal, mapped_file *mf);
+float *map_chunk(char *filename, long dims, long first, long count, mapped_file *mf);
+void unmap_points(mapped_file *mf);
+
+#endif
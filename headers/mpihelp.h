@@ -3,17 +3,49 @@
 
 #include <stdio.h>
 
-void bcast_dims_points(FILE *file, long *info, int comm_rank, int comm_size);
+void bcast_dims_points(FILE *file, long *info, int comm_rank);
 void split_into_processes(FILE *file, process *p, float *points);
+void mpiio_open(char *filename, MPI_File *fh);
+void mpiio_dims_points(MPI_File fh, long *info);
+void mpiio_split_into_processes(MPI_File fh, process *p, float *points);
+void shared_dims_points(char *filename, long *info, shared_points *sh);
+void shared_split_into_processes(process *p, shared_points *sh);
+void quantize_point(const float *in, float *out, process *p);
+float *compact_points(float *points, process *p);
+float *index_points(float *points, process *p);
+void tile_points(float *points, process *p);
+void pointDistances(float *points, long n, float *out, process *p);
+void workspace_init(workspace *ws, process *p);
+void workspace_free(workspace *ws);
+bool read_query_pivot(FILE *in, process *p);
+float partitionByPivot(float *points, float *distances, process *p);
 void bcast_pivot(process *p, float *pivot, float *points);
+void bcast_group_pivot(float *points, MPI_Comm comm, process *p);
+
+long groupSplitTarget(MPI_Comm comm, process *p);
+float distributedMedian(float *distances, MPI_Comm comm, process *p);
+float histogramMedian(float *distances, MPI_Comm comm, process *p);
+float findMedian(float *distances, float *dist_array, MPI_Comm comm, process *p);
 
 int *sortByMedian(float *array, float *points, float median, process *p);
+int *sortByMedianSwap(float *array, float *points, float median, process *p);
+int *sortByMedianParallel(float *array, float *points, float median, process *p);
+int *sortByMedianIndexed(float *array, float *points, float median, process *p);
 
-void findNewMedian(float *points, int *unwantedMat, float *distances, float *dist_array, bool *sortedMat,
+void splitTies(int *sorted, float *points, float *distances, float median, int *unwantedMat,
+    MPI_Comm comm, process *p);
+float findNewMedian(float *points, int *unwantedMat, float *distances, float *dist_array,
     float median, MPI_Comm new_comm, process *p);
 void splitGroup(MPI_Comm *comm, MPI_Comm *new_comm, int *my_new_comm_rank, int *my_new_comm_size,
     int colour, int key, process *p);
+long pipelineChunkPoints(process *p);
+void pipelinedExchange(float *block, float *distBlock, long count, int peer, MPI_Comm comm,
+    float *buffers, process *p);
+void groupTopology(MPI_Comm comm, process *p);
+void alltoallExchange(int *unwantedMat, float *points, float *distances, MPI_Comm comm, process *p);
+void splitAndDistribute(int *unwantedMat, float *points, float *distances, process *p,
+    float median, MPI_Comm comm);
 void distributeByMedian(int *unwantedMat, float *points, float *distances,
-    process *p, float median, MPI_Comm comm, bool *sortedMat, int pseudo); 
+    process *p, float median, MPI_Comm comm); 
 
 #endif
\ No newline at end of file
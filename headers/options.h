@@ -0,0 +1,139 @@
+/**
+ * @file: options.h
+ * ********************
+ * @description: Run-time options of the algorithm, parsed from the command
+ * line and carried inside the process struct.
+ */ 
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// How the median distance of a group of processes is found.
+typedef enum {
+    // Gather every distance to the group's master and quickselect there.
+    SELECT_GATHER,
+    // Weighted median of medians rounds. Only O(p) values travel per round.
+    SELECT_DISTRIBUTED,
+    // Histograms of the distances, refined around the median. Only O(bins) values travel per round.
+    SELECT_HISTOGRAM
+} select_mode;
+
+// How sortByMedian moves the points around.
+typedef enum {
+    // Swap whole points every time a distance is swapped.
+    PARTITION_SWAP,
+    // Partition (distance, index) pairs and move every point once at the end.
+    PARTITION_INDEX
+} partition_mode;
+
+// How the points are read from the binary file.
+typedef enum {
+    // The master reads every chunk and sends it to its process.
+    LOAD_MASTER,
+    // Every process reads its own chunk in parallel, with collective MPI-IO.
+    LOAD_MPIIO,
+    // One process per node maps the file into a window shared by the node.
+    LOAD_MMAP
+} load_mode;
+
+// How two processes trade their unwanted points in distributeByMedian.
+typedef enum {
+    // A single blocking MPI_Sendrecv_replace of the whole block.
+    EXCHANGE_REPLACE,
+    // The block is split in chunks sent and received with non-blocking calls.
+    EXCHANGE_PIPELINE,
+    // Every trade of the level is planned locally and done in one MPI_Alltoallv.
+    EXCHANGE_ALLTOALL
+} exchange_mode;
+
+// How the points are kept in memory and traded between processes.
+typedef enum {
+    // The float32 values of the file.
+    FORMAT_FLOAT,
+    // One byte per coordinate, scaled to the range of the dataset.
+    FORMAT_UINT8,
+    // Half precision, scaled to the range of the dataset.
+    FORMAT_FP16,
+    // Not a --format: the stream_records of --stream, which only hold their distance.
+    FORMAT_RECORD
+} format_mode;
+
+// Which processes of the two halves trade their unwanted points with each other.
+typedef enum {
+    // In rank order, wherever the processes are.
+    PAIRING_RANK,
+    // Processes of the same node first, only the rest cross nodes.
+    PAIRING_NODE
+} pairing_mode;
+
+// Which processes take part in the distributed recursion.
+typedef enum {
+    // Every process, on its own chunk.
+    HIERARCHY_FLAT,
+    // The leader of every node, on the points of the whole node. The node then splits them with threads.
+    HIERARCHY_NODE
+} hierarchy_mode;
+
+// What the self-check at the end of a run looks at.
+typedef enum {
+    // That the distances of the processes are in order.
+    VERIFY_ORDER,
+    // That, and that the same points are still there, by checksum.
+    VERIFY_DEEP
+} verify_mode;
+
+// How the float points are laid out for the first distance pass.
+typedef enum {
+    // One point after the other, each one taking dims floats.
+    LAYOUT_ROWS,
+    // Tiles of DISTANCE_TILE points, a coordinate of every point of the tile after the other.
+    LAYOUT_BLOCKED
+} layout_mode;
+
+// How the pivot of a group is picked.
+typedef enum {
+    // A point drawn uniformly from every point of the group, with the seed of the run.
+    PIVOT_RANDOM,
+    // The point farthest from a random one, which lies on the rim of the dataset.
+    PIVOT_FARTHEST,
+    // The point with the smallest value along the dimension of the largest variance.
+    PIVOT_VARIANCE,
+    // The point of a file, for the first pivot. Groups pick theirs at random.
+    PIVOT_USER
+} pivot_mode;
+
+typedef struct {
+    select_mode select;
+    partition_mode partition;
+    load_mode load;
+    exchange_mode exchange;
+    // File to read pivots from, one per line, or "-" for stdin. NULL for a single run.
+    char *queries;
+    // Prefix of the vantage point tree files, one per process. NULL to not build one.
+    char *vptree;
+    // Neighbours returned for each query of the tree.
+    int k;
+    // OpenMP threads of every process, 0 to keep the OpenMP defaults. With more than one,
+    // the partition and the master's selection are split between the threads too.
+    int threads;
+    format_mode format;
+    // File the per-phase profile of every process is summarized in, NULL to not write one.
+    char *profile;
+    // Binary file of the points, in the format of data/binmake.jl.
+    char *data;
+    // Seed of the pivot choices, -1 for a different one every run.
+    long seed;
+    pivot_mode pivot;
+    // File holding the coordinates of the pivot, for PIVOT_USER.
+    char *pivotFile;
+    // Prefix of the output files of the out-of-core mode, NULL to keep the points in memory.
+    char *stream;
+    pairing_mode pairing;
+    hierarchy_mode hierarchy;
+    verify_mode verify;
+    layout_mode layout;
+} options;
+
+void parse_options(int argc, char **argv, options *opt);
+
+#endif
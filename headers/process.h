@@ -10,6 +10,11 @@
 
 #include <mpi.h>
 
+#include "options.h"
+#include "format.h"
+#include "workspace.h"
+#include "profile.h"
+
 typedef struct {
     int comm_size;
     int comm_rank;
@@ -18,6 +23,18 @@ typedef struct {
     float *pivot;
 
     MPI_Status *mpi_stat101;
+    options *opt;
+    workspace *ws;
+    // How many times the group has been split so far.
+    int level;
+    // Records every split of the group, NULL unless a vantage point tree is built.
+    struct vp_tree *tree;
+    // How the points are stored, p->dims is the floats each one takes up.
+    point_format *format;
+    // Where the time and the traffic of the process go.
+    struct profile *prof;
+    // The processes the whole recursion runs on, the node leaders only with --hierarchy node.
+    MPI_Comm world;
 } process;
 
 #endif
\ No newline at end of file
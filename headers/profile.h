@@ -0,0 +1,55 @@
+/**
+ * @file: profile.h
+ * ********************
+ * @description: Per-phase timers of a run, along with the bytes traded and the
+ * exchange rounds of every recursion level. Every process keeps its own, and
+ * profile_report combines them as min/mean/max over the processes.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <mpi.h>
+
+// Deepest level whose traffic is kept, the same as the communicator cache.
+#define PROFILE_MAX_LEVELS 64
+
+// What a process spends its time on.
+typedef enum {
+    // Reading the points and splitting them into processes.
+    PHASE_IO,
+    // Distances from the pivot.
+    PHASE_DISTANCE,
+    // Finding the median of the group, gathering the distances included.
+    PHASE_SELECT,
+    // sortByMedian, moving the unwanted points to the end.
+    PHASE_PARTITION,
+    // Trading unwanted points with the other half.
+    PHASE_EXCHANGE,
+    // MPI_Comm_split and the new ranks.
+    PHASE_SPLIT,
+    // Collectives that only tell who is done, and the barrier at the end of the run.
+    PHASE_WAIT,
+    PHASE_COUNT
+} profile_phase;
+
+typedef struct profile {
+    double seconds[PHASE_COUNT];
+    double started[PHASE_COUNT];
+    // Wall time of the whole partition, start to end.
+    double total;
+
+    // Bytes of points this process sent and exchange rounds it went through, per level.
+    long bytes[PROFILE_MAX_LEVELS];
+    long rounds[PROFILE_MAX_LEVELS];
+    // Levels this process went through.
+    int levels;
+} profile;
+
+void profile_init(profile *prof);
+void profile_start(profile *prof, profile_phase phase);
+void profile_stop(profile *prof, profile_phase phase);
+void profile_exchange(profile *prof, int level, long bytes, long rounds);
+void profile_report(profile *prof, char *filename, MPI_Comm comm);
+
+#endif
@@ -0,0 +1,24 @@
+/**
+ * @file: rng.h
+ * ********************
+ * @description: A small seeded random number generator (splitmix64), so that the
+ * same seed gives the same numbers on every machine, unlike rand().
+ */ 
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t state;
+} rng;
+
+void rng_seed(rng *r, uint64_t seed);
+uint64_t rng_next(rng *r);
+uint64_t rng_stream(uint64_t seed, uint64_t stream);
+double rng_uniform(rng *r);
+double rng_normal(rng *r);
+long rng_below(rng *r, long n);
+
+#endif
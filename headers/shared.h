@@ -0,0 +1,34 @@
+/**
+ * @file: shared.h
+ * ********************
+ * @description: Memory mapped input of --load mmap. With --hierarchy node the points
+ * of all the processes of a node are kept in a single shared memory window that the
+ * node's leader fills from the mapped file. Otherwise every process maps its own chunk.
+ */ 
+
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <mpi.h>
+
+#include "mapfile.h"
+
+typedef struct {
+    // The processes that share memory with this one.
+    MPI_Comm node;
+    int node_rank;
+    int node_size;
+
+    // Only with --hierarchy node.
+    MPI_Win win;
+    // The whole file on the node's leader, until the chunks are in place. Then the
+    // process's own chunk, without --hierarchy node.
+    mapped_file map;
+    float *file_points;
+    char *filename;
+
+    // This process's own chunk, inside the window or mapped.
+    float *chunk;
+} shared_points;
+
+#endif
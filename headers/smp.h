@@ -0,0 +1,34 @@
+/**
+ * @file: smp.h
+ * ********************
+ * @description: Shared-memory engine. Does the partitioning of mpi_a.c on a
+ * single node, where every "process" is a range of one array of points.
+ */ 
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdbool.h>
+
+typedef struct {
+    // Every point, dims floats each, and its distance from the pivot.
+    float *points;
+    float *distances;
+    long dims;
+    long pointsTotal;
+    // How many ranges the points are split in, like the processes of mpi_a.c.
+    int parts;
+
+    // Scratch space of the selection and the lists of misplaced points.
+    // A range only ever touches its own part of them.
+    float *selectA;
+    float *selectB;
+    long *lists;
+} smp_engine;
+
+void smp_init(smp_engine *e, float *points, float *distances, long dims, long pointsTotal, int parts);
+void smp_free(smp_engine *e);
+void smp_distribute(smp_engine *e);
+bool smp_check(smp_engine *e);
+
+#endif
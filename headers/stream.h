@@ -0,0 +1,34 @@
+/**
+ * @file: stream.h
+ * ********************
+ * @description: Out-of-core mode. The points stay on disk: every process reads its
+ * chunk in blocks, once to find the distances from the pivot and once more at the
+ * end to hand the points to the processes that own them. In between, the recursion
+ * partitions records that only hold a distance and where the point lies in the file.
+ */ 
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <mpi.h>
+
+#include "process.h"
+
+// Bytes of points every process reads from the file at a time.
+#define STREAM_BLOCK_BYTES (1 << 26)
+
+// What the recursion keeps of a point, traded like any other point of p->dims floats.
+typedef struct {
+    float dist;
+    // The process whose chunk holds the point and its index in the chunk.
+    int origin;
+    long offset;
+} stream_record;
+
+#define STREAM_RECORD_FLOATS (sizeof(stream_record) / sizeof(float))
+
+void stream_pivot(MPI_File fh, process *p);
+float *stream_records(MPI_File fh, process *p);
+void stream_write(MPI_File fh, float *records, char *prefix, process *p);
+
+#endif
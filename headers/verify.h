@@ -0,0 +1,21 @@
+/**
+ * @file: verify.h
+ * ********************
+ * @description: Self-check of a run, cheap enough to always be on. The order of
+ * the processes is checked with a single pass over the distances and one message
+ * per process, and the optional deep check tells whether every point is still there,
+ * unchanged, with a checksum of the points of the world.
+ */ 
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "process.h"
+
+bool verify_order(float *distances, process *p);
+void verify_checksum(float *points, process *p, long *count, uint64_t *checksum);
+
+#endif
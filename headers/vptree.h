@@ -0,0 +1,77 @@
+/**
+ * @file: vptree.h
+ * ********************
+ * @description: Vantage point tree built on top of distributeByMedian. Every split
+ * of a group of processes is a node of the tree, whose pivot and median radius are
+ * recorded by the processes of the group. Once a process is alone, it keeps building
+ * the tree over its own points.
+ */ 
+
+#ifndef VPTREE_H
+#define VPTREE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Nodes with fewer points are not split any further.
+#define VP_LEAF_SIZE 16
+// Deepest distributed path, the same as the communicator cache.
+#define VP_MAX_LEVELS 64
+// Floats after the coordinates of every point, holding its index in the dataset.
+#define VP_ID_FLOATS (sizeof(long) / sizeof(float))
+
+// A node of the local part of the tree. Its points are [start, end) of the local
+// points: the vantage point at start, then the points inside the radius and then
+// the ones outside. Leaves have no vantage point and keep all of them in a bucket.
+typedef struct {
+    long start;
+    long end;
+    // Index of the first point outside the radius.
+    long mid;
+    float radius;
+    // Children, -1 if there is none.
+    long inside;
+    long outside;
+    bool leaf;
+} vp_node;
+
+typedef struct vp_tree {
+    long dims;
+    // Floats every point takes up: its dims coordinates, then its index in the dataset.
+    long stride;
+
+    // The splits of the groups this process belonged to, from the top.
+    int levels;
+    float *pathPivots;
+    float *pathRadii;
+    // Whether the process ended up inside the radius of each split.
+    bool *pathInside;
+
+    // The local part of the tree, over the points of this process.
+    long pointsNum;
+    float *points;
+    vp_node *nodes;
+    long nodesNum;
+    long nodesCap;
+
+    // The lists of vptree_knn, for k neighbours. Those of every process only on the master.
+    int k;
+    float *localDist;
+    long *localIndex;
+    float *allDist;
+    long *allIndex;
+    int *heads;
+} vp_tree;
+
+void vptree_init(vp_tree *t, long dims);
+void vptree_free(vp_tree *t);
+void vptree_record_level(vp_tree *t, float *pivot, float median, bool inside);
+void vptree_build_local(vp_tree *t, float *points, long pointsNum);
+long vptree_index(vp_tree *t, long i);
+void vptree_write(vp_tree *t, char *filename);
+
+float vptree_lower_bound(vp_tree *t, float *query);
+int vptree_search_local(vp_tree *t, float *query, int k, float bound, float *bestDist, long *bestIndex);
+int vptree_knn(vp_tree *t, float *query, int k, float *bestDist, long *bestIndex);
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * @file: workspace.h
+ * ********************
+ * @description: Every buffer the recursion needs, allocated once before the
+ * first call of distributeByMedian and sized for its deepest level, so that the
+ * levels themselves never touch the heap.
+ */ 
+
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <stdbool.h>
+#include <mpi.h>
+
+#include "rng.h"
+
+// Deepest recursion the communicator cache can hold.
+#define MAX_LEVELS 64
+
+// A distance along with the index of the point it belongs to.
+typedef struct {
+    float dist;
+    long index;
+} dist_index;
+
+typedef struct {
+    // The stream the pivots are drawn from. Every process of a group has drawn as many.
+    rng pivots;
+
+    // How many points every process of MPI_COMM_WORLD holds and where they start in the file.
+    long *worldCounts;
+    long *worldOffsets;
+    // The same for the current group, as Gatherv wants them.
+    int *groupCounts;
+    int *groupDispls;
+
+    // A whole point, as stored, for the exchanges.
+    MPI_Datatype point;
+
+    // One value per process of the largest group.
+    int *unwantedMat;
+    // How many points of every process are below, equal to and above the median.
+    int *tieCounts;
+
+    // What sortByMedian returns.
+    int sorted[3];
+
+    // Gathered distances, on the processes that can be a group's master.
+    float *dist_array;
+
+    // Distributed selection, or the distances of the farthest pivot.
+    float *work;
+    double *weighted;
+
+    // The variance pivot: the sums and the sums of squares of every coordinate.
+    double *sums;
+
+    // Histogram selection: the local and the global bins, then the last candidates.
+    long *histogram;
+    float *candidates;
+
+    // Index based partitioning.
+    dist_index *pairs;
+    long *perm;
+    float *row;
+
+    // Thread-parallel partition and selection. The partition swaps the points in place,
+    // only the distances of tiled points go through scratchDist.
+    float *scratchDist;
+    float *selectScratch;
+    // The points of every thread's block of a class, or where a thread writes its wanted,
+    // unwanted and median points out of the tiles, after a row of totals.
+    long *threadCounts;
+
+    // The points in tiles, for the first distances of --layout blocked.
+    float *tiles;
+
+    // Pipelined exchange.
+    float *buffers;
+
+    // All-to-all exchange.
+    long *tailStart;
+    int *counts;
+    int *zeros;
+    MPI_Datatype *types;
+
+    // The node of every process of MPI_COMM_WORLD, numbered from 0. Every process is on
+    // node 0 unless the pairing follows the nodes.
+    int *worldNodes;
+    int nodeCount;
+    // The node of every process of the current group, and the group's ranks ordered by node.
+    int *groupNodes;
+    int *nodeOrder;
+    // Per node and half: the unwanted points, then where the ones that cross nodes start.
+    long *nodeSums;
+
+    // The communicator of each level. The groups only depend on the ranks, so
+    // they are split once and reused by every pivot of a run.
+    MPI_Comm comms[MAX_LEVELS];
+} workspace;
+
+#endif
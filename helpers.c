@@ -1,16 +1,43 @@
-#ifndef HELPERS_H
-#define HELPERS_H
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <math.h>
+#include <string.h>
+#include <float.h>
+#include <omp.h>
 
-#include "headers/process.h"
 #include "headers/helpers.h"
+#include "headers/rng.h"
 
 #define SWAP(x, y) { float temp = x; x = y; y = temp; }
 
+// Below this many values the selection is not worth splitting between threads.
+#define PARALLEL_SELECT_MIN (1 << 16)
+
+// Seed of the selections of this process. Every thread draws from a stream of its own,
+// seeded again whenever the seed changes.
+static uint64_t selectionSeed = 0;
+static unsigned selectionEpoch = 1;
+static _Thread_local rng selectionRng;
+static _Thread_local unsigned selectionRngEpoch = 0;
+
+
+// Seeds the random pivots of the selections, kthSmallest included.
+void seedSelection(uint64_t seed) {
+	selectionSeed = seed;
+	selectionEpoch++;
+}
+
+
+// A random index in [0, n) for a selection, reproducible for the same seed and thread.
+long selectionRandom(long n) {
+	if (selectionRngEpoch != selectionEpoch) {
+		rng_seed(&selectionRng, rng_stream(selectionSeed, omp_get_thread_num()));
+		selectionRngEpoch = selectionEpoch;
+	}
+	return rng_below(&selectionRng, n);
+}
+
 
 // Calculates the max power of base that's closer to num.
 int maxPower(int num, int base, int rep) {
@@ -25,19 +52,8 @@ int maxPower(int num, int base, int rep) {
 }
 
 
-// Calculates the distance of p from a reference point, given in the form of an array.
-float calculateDistanceArray(float *p, int start, float *ref, uint dims) {
-	float distance = 0;
-	for (int i = 0; i < dims; i++) {
-		distance += pow(p[start + i] - ref[i], 2);
-	}
-
-	return distance;
-}
-
-
 // Partition using Lomuto partition scheme
-int partition(float* a, int left, int right, int pIndex)
+long partition(float* a, long left, long right, long pIndex)
 {
 	// pick `pIndex` as a pivot from the array
 	float pivot = a[pIndex];
@@ -52,7 +68,7 @@ int partition(float* a, int left, int right, int pIndex)
  
 	// each time we find an element less than or equal to the pivot, `pIndex`
 	// is incremented, and that element would be placed before the pivot.
-	for (int i = left; i < right; i++)
+	for (long i = left; i < right; i++)
 	{
 		if (a[i] <= pivot)
 		{
@@ -72,7 +88,7 @@ int partition(float* a, int left, int right, int pIndex)
 // (i.e., left <= k <= right). The search space within the array is
 // changing for each round – but the list is still the same size.
 // Thus, `k` does not need to be updated with each round.
-float kthSmallest(float* nums, int left, int right, int k)
+float kthSmallest(float* nums, long left, long right, long k)
 {
 	// If the array contains only one element, return that element
 	if (left == right) {
@@ -80,7 +96,7 @@ float kthSmallest(float* nums, int left, int right, int k)
 	}
  
 	// select `pIndex` between left and right
-	int pIndex = left + rand() % (right - left + 1);
+	long pIndex = left + selectionRandom(right - left + 1);
  
 	pIndex = partition(nums, left, right, pIndex);
  
@@ -100,9 +116,184 @@ float kthSmallest(float* nums, int left, int right, int k)
 	}
 }
 
-float quickselect(float *distances, uint end) {
+/**
+ * Three-way partition of a[left...right-1] around a value, without moving it first.
+ * On return [left, lt) holds the smaller elements, [lt, gt) the ones equal
+ * to the value and [gt, right) the larger ones.
+ */
+void partition3(float *a, long left, long right, float value, long *lt, long *gt) {
+	long i = left;
+	*lt = left;
+	*gt = right;
+
+	while (i < *gt) {
+		if (a[i] < value) {
+			SWAP(a[i], a[*lt]);
+			(*lt)++;
+			i++;
+		} else if (a[i] > value) {
+			(*gt)--;
+			SWAP(a[i], a[*gt]);
+		} else {
+			i++;
+		}
+	}
+}
+
+/**
+ * The value that splits n distances in the k smallest ones and the rest:
+ * halfway between the k-th and the (k+1)-th smallest, k < n. With k = 0 it is the smallest.
+ * With k = n / 2 it is the median of an even population.
+ */
+float splitValue(float *distances, long n, long k) {
+	if (k == 0) {
+		return kthSmallest(distances, 0, n - 1, 0);
+	}
+
+	float mid1 = kthSmallest(distances, 0, n - 1, k - 1);
+	float mid2 = kthSmallest(distances, 0, n - 1, k);
+
+	return (float) ((mid1 + mid2) / 2);
+}
+
+
+// The points [offset, offset + count) of total that belong to one of parts processes.
+// The first total % parts processes get one point more than the rest.
+void rankChunk(long total, int parts, int index, long *count, long *offset) {
+	long base = total / parts;
+	long extra = total % parts;
+
+	*count = base + (index < extra);
+	*offset = index * base + ((index < extra) ? index : extra);
+}
+
+
+/**
+ * Copies the values of src that are below (or above) the pivot to dst, keeping their order.
+ * Each thread counts its own block first, so that it knows where to write.
+ * Returns how many were copied.
+ */
+static long compactParallel(const float *src, long n, float *dst, float pivot, bool below) {
+	long *offsets = (long *) malloc((omp_get_max_threads() + 1) * sizeof(long));
+	int threads = 1;
+
+	#pragma omp parallel
+	{
+		int t = omp_get_thread_num();
+		#pragma omp single
+		threads = omp_get_num_threads();
+
+		long start = n * t / threads, end = n * (t + 1) / threads;
+		long count = 0;
+		for (long i = start; i < end; i++) {
+			count += (below) ? src[i] < pivot : src[i] > pivot;
+		}
+		offsets[t + 1] = count;
+
+		#pragma omp barrier
+		#pragma omp single
+		{
+			offsets[0] = 0;
+			for (int i = 1; i <= threads; i++) {
+				offsets[i] += offsets[i - 1];
+			}
+		}
+
+		long pos = offsets[t];
+		for (long i = start; i < end; i++) {
+			if ((below) ? src[i] < pivot : src[i] > pivot) {
+				dst[pos++] = src[i];
+			}
+		}
+	}
+
+	long total = offsets[threads];
+	free(offsets);
+	return total;
+}
+
+
+/**
+ * The k-th smallest of the n values of a, found by the thread team.
+ * Every round the values below and equal to a random pivot are counted in parallel,
+ * and the side that holds the k-th value is copied to the other buffer.
+ * Small ranges are left to kthSmallest. Both a and scratch (n floats) are overwritten.
+ * @param next: if not NULL, gets the (k+1)-th smallest value, FLT_MAX if there is none.
+ */
+float parallelSelect(float *a, long n, long k, float *scratch, float *next) {
+	float *src = a, *dst = scratch;
+	// The smallest value ever thrown away from the top.
+	float ceiling = FLT_MAX;
+
+	while (n >= PARALLEL_SELECT_MIN) {
+		float pivot = src[selectionRandom(n)];
+
+		long lt = 0, eq = 0;
+		#pragma omp parallel for reduction(+:lt, eq) schedule(static)
+		for (long i = 0; i < n; i++) {
+			lt += src[i] < pivot;
+			eq += src[i] == pivot;
+		}
+
+		if (k < lt) {
+			ceiling = pivot;
+			n = compactParallel(src, n, dst, pivot, true);
+		} else if (k < lt + eq) {
+			if (next != NULL) {
+				float larger = ceiling;
+				if (k + 1 < lt + eq) {
+					larger = pivot;
+				} else {
+					#pragma omp parallel for reduction(min:larger) schedule(static)
+					for (long i = 0; i < n; i++) {
+						if (src[i] > pivot && src[i] < larger) {
+							larger = src[i];
+						}
+					}
+				}
+				*next = larger;
+			}
+			return pivot;
+		} else {
+			k -= lt + eq;
+			n = compactParallel(src, n, dst, pivot, false);
+		}
+
+		float *temp = src; src = dst; dst = temp;
+	}
+
+	float result = kthSmallest(src, 0, n - 1, k);
+	if (next != NULL) {
+		// Everything after the k-th value is at least as large as it.
+		float larger = ceiling;
+		for (long i = k + 1; i < n; i++) {
+			if (src[i] < larger) {
+				larger = src[i];
+			}
+		}
+		*next = larger;
+	}
+
+	return result;
+}
+
+
+// Same as splitValue, on the thread team. Overwrites distances and scratch (n floats).
+float parallelSplitValue(float *distances, long n, long k, float *scratch) {
+	if (k == 0) {
+		return parallelSelect(distances, n, 0, scratch, NULL);
+	}
+
+	float mid2;
+	float mid1 = parallelSelect(distances, n, k - 1, scratch, &mid2);
+
+	return (float) ((mid1 + mid2) / 2);
+}
+
+
+float quickselect(float *distances, long end) {
 	// The index where the median is supposed to be.
-	uint mid_index = (end + 1) / 2;
+	long mid_index = (end + 1) / 2;
 
 	// The median is calculated depending on whether the population is even or odd.
 	if ((end + 1) % 2 == 0) {
@@ -115,7 +306,6 @@ float quickselect(float *distances, uint end) {
 	
 		return (float) ((mid1 + mid2) / 2);
 	} else {
-		printf("To kalo to palikari paei apo allo monopati\n");
 		return kthSmallest(distances, 0, end, mid_index);
 	}
 	
@@ -137,6 +327,31 @@ void swapFloat(float *array, long x, long y, long len) {
 }
 
 
+/**
+ * Moves chunks of len values so that chunk j ends up holding what chunk perm[j] held.
+ * Follows the cycles of the permutation, so every chunk is copied exactly once,
+ * using temp (len values) as the only extra space. perm is destroyed.
+ */
+void permuteChunks(float *array, long *perm, long n, long len, float *temp) {
+	for (long start = 0; start < n; start++) {
+		if (perm[start] == start) {
+			continue;
+		}
+
+		memcpy(temp, &array[start * len], len * sizeof(float));
+		long j = start;
+		while (perm[j] != start) {
+			long next = perm[j];
+			memcpy(&array[j * len], &array[next * len], len * sizeof(float));
+			perm[j] = j;
+			j = next;
+		}
+		memcpy(&array[j * len], temp, len * sizeof(float));
+		perm[j] = j;
+	}
+}
+
+
 // Swap for integer arrays. 
 void swapInt(int *array, long x, long y, long len) {
 	for (long i = 0; i < len; i++) {
@@ -144,8 +359,4 @@ void swapInt(int *array, long x, long y, long len) {
 		array[x+i] = array[y+i];
 		array[y+i] = temp;
 	}
-}
-
-
-
-#endif
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,143 @@
+/**
+ * @file: hierarchy.c
+ * ********************
+ * @description: Two-level mode. Between nodes, the leaders trade the points of their
+ * nodes with distributeByMedian, in fewer and larger messages than every process would.
+ * Within a node, nothing is copied at all: the leader splits the node's part of the
+ * points in place, in the shared window, and every process finds its own chunk there.
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <mpi.h>
+#include <omp.h>
+
+#include "headers/options.h"
+#include "headers/process.h"
+#include "headers/shared.h"
+#include "headers/workspace.h"
+#include "headers/mpihelp.h"
+#include "headers/profile.h"
+#include "headers/smp.h"
+#include "headers/hierarchy.h"
+
+
+// Waits for the rest of the node without spinning, since the leader's threads use every core of it.
+static void nodeWait(MPI_Comm node, process *p) {
+    struct timespec nap = {0, 50000};
+    MPI_Request request;
+    int done = 0;
+
+    profile_start(p->prof, PHASE_WAIT);
+    MPI_Ibarrier(node, &request);
+    MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    while (!done) {
+        nanosleep(&nap, NULL);
+        MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    }
+    profile_stop(p->prof, PHASE_WAIT);
+}
+
+
+/**
+ * Splits off the leaders and shares a distance per point of the node. Each leader gets
+ * a process of its own, which holds the points of the whole node and runs a thread for
+ * every process of the node. The parts of the nodes only line up with the chunks of the
+ * processes if the ranks of every node are contiguous.
+ */
+void hierarchy_init(hierarchy *h, process *p, shared_points *sh) {
+    int lowest = p->comm_rank, highest = p->comm_rank;
+    MPI_Allreduce(MPI_IN_PLACE, &lowest, 1, MPI_INT, MPI_MIN, sh->node);
+    MPI_Allreduce(MPI_IN_PLACE, &highest, 1, MPI_INT, MPI_MAX, sh->node);
+    int contiguous = highest - lowest + 1 == sh->node_size;
+    MPI_Allreduce(MPI_IN_PLACE, &contiguous, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (!contiguous) {
+        if (p->comm_rank == 0) {
+            printf("--hierarchy node needs the ranks of every node to be contiguous, place them by core.\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    MPI_Comm_split(MPI_COMM_WORLD, (sh->node_rank == 0) ? 0 : MPI_UNDEFINED, p->comm_rank, &h->leaders);
+
+    // The leader's chunk starts the node's points, the rest follow in rank order.
+    MPI_Aint size;
+    int disp_unit;
+    MPI_Win_shared_query(sh->win, 0, &size, &disp_unit, &h->points);
+    h->nodePoints = size / (p->dims * sizeof(float));
+
+    size = (sh->node_rank == 0) ? (MPI_Aint) h->nodePoints * sizeof(float) : 0;
+    MPI_Win_allocate_shared(size, sizeof(float), MPI_INFO_NULL, sh->node, &h->distances, &h->distWin);
+    MPI_Win_shared_query(h->distWin, 0, &size, &disp_unit, &h->distances);
+
+    if (h->leaders != MPI_COMM_NULL) {
+        h->opt = *p->opt;
+        h->opt.threads = sh->node_size * ((p->opt->threads > 1) ? p->opt->threads : 1);
+        // Bound to the cores of a single process, the threads would take turns on them.
+        if (omp_get_num_procs() < h->opt.threads) {
+            printf("The leader of process %d runs %d threads on %d cores, start the processes with --bind-to none.\n",
+                p->comm_rank, h->opt.threads, omp_get_num_procs());
+        }
+        // Every leader is on a node of its own.
+        h->opt.pairing = PAIRING_RANK;
+
+        h->leader = *p;
+        MPI_Comm_rank(h->leaders, &h->leader.comm_rank);
+        MPI_Comm_size(h->leaders, &h->leader.comm_size);
+        h->leader.pointsNum = h->nodePoints;
+        h->leader.opt = &h->opt;
+        h->leader.ws = &h->ws;
+        h->leader.world = h->leaders;
+        workspace_init(&h->ws, &h->leader);
+    }
+}
+
+
+/**
+ * The leaders partition the points of their nodes around a single pivot, the same way
+ * the processes of the flat mode partition their own. Every node then holds exactly the
+ * points of its processes, and its leader sorts them between the processes with the
+ * shared-memory engine, while the rest of the node waits.
+ * Returns the distances of the process's own points, in the shared window.
+ */
+float *hierarchy_distribute(hierarchy *h, process *p, shared_points *sh) {
+    if (h->leaders != MPI_COMM_NULL) {
+        process *l = &h->leader;
+        omp_set_num_threads(h->opt.threads);
+
+        bcast_pivot(l, l->pivot, h->points);
+        pointDistances(h->points, h->nodePoints, h->distances, l);
+        float median = findMedian(h->distances, h->ws.dist_array, h->leaders, l);
+        int *sortedByMedian = sortByMedian(h->distances, h->points, median, l);
+        splitTies(sortedByMedian, h->points, h->distances, median, h->ws.unwantedMat, h->leaders, l);
+        distributeByMedian(h->ws.unwantedMat, h->points, h->distances, l, median, h->leaders);
+
+        profile_start(p->prof, PHASE_PARTITION);
+        smp_engine engine;
+        smp_init(&engine, h->points, h->distances, p->dims, h->nodePoints, sh->node_size);
+        smp_distribute(&engine);
+        smp_free(&engine);
+        profile_stop(p->prof, PHASE_PARTITION);
+    }
+
+    nodeWait(sh->node, p);
+    MPI_Win_fence(0, sh->win);
+    MPI_Win_fence(0, h->distWin);
+    MPI_Bcast(p->pivot, p->dims, MPI_FLOAT, 0, sh->node);
+
+    return &h->distances[(sh->chunk - h->points) / p->dims];
+}
+
+
+void hierarchy_free(hierarchy *h, shared_points *sh) {
+    if (h->leaders != MPI_COMM_NULL) {
+        workspace_free(&h->ws);
+        MPI_Comm_free(&h->leaders);
+    }
+    MPI_Win_free(&h->distWin);
+    MPI_Win_free(&sh->win);
+    MPI_Comm_free(&sh->node);
+}
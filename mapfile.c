@@ -0,0 +1,100 @@
+/**
+ * @file: mapfile.c
+ * ********************
+ * @description: Memory mapped input. The file is mapped privately, so pages are
+ * read straight from the page cache, shared with every other process mapping the
+ * same file, and only get copied if the caller writes to them.
+ */ 
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "headers/mapfile.h"
+
+
+/**
+ * Maps a whole binary file and returns a pointer to its first point.
+ * The two integers of the header are written to dims and pointsTotal.
+ * Returns NULL if the file could not be mapped.
+ */ 
+float *map_points(char *filename, long *dims, long *pointsTotal, mapped_file *mf) {
+    mf->base = NULL;
+    mf->length = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 2 * (long) sizeof(long)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Writable but private: writes never reach the file.
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    mf->base = base;
+    mf->length = st.st_size;
+
+    long *header = (long *) base;
+    *dims = header[0];
+    *pointsTotal = header[1];
+
+    return (float *) (header + 2);
+}
+
+
+/**
+ * Maps count points of a binary file privately, starting from point first, and returns
+ * a pointer to them. Only the pages that get written are ever copied.
+ * Returns NULL if the file could not be mapped.
+ */ 
+float *map_chunk(char *filename, long dims, long first, long count, mapped_file *mf) {
+    mf->base = NULL;
+    mf->length = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // The offset of a mapping has to fall on a page.
+    long start = 2 * sizeof(long) + first * dims * sizeof(float);
+    long page = sysconf(_SC_PAGESIZE);
+    long skip = start % page;
+    size_t length = skip + count * dims * sizeof(float);
+    if (length == 0) {
+        length = 1;
+    }
+
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start - skip);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    mf->base = base;
+    mf->length = length;
+
+    return (float *) ((char *) base + skip);
+}
+
+
+void unmap_points(mapped_file *mf) {
+    if (mf->base != NULL) {
+        munmap(mf->base, mf->length);
+        mf->base = NULL;
+        mf->length = 0;
+    }
+}
@@ -24,111 +24,391 @@
 #include <time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <omp.h>
 
+#include "headers/options.h"
 #include "headers/process.h"
+#include "headers/shared.h"
+#include "headers/workspace.h"
 #include "headers/helpers.h"
 #include "headers/mpihelp.h"
+#include "headers/distance.h"
+#include "headers/vptree.h"
+#include "headers/profile.h"
+#include "headers/rng.h"
+#include "headers/stream.h"
+#include "headers/hierarchy.h"
+#include "headers/verify.h"
 
 
 int main(int argc, char **argv) {
 
 	int comm_size, comm_rank;
-    MPI_Status *mpi_stat101;
+    MPI_Status *mpi_stat101 = MPI_STATUS_IGNORE;
     MPI_Request *mpi_req101;
-    srand((unsigned) time(NULL));
 
 	// --------------- START OF TESTING MPI --------------- //
-	MPI_Init(&argc, &argv);
+	// Only the main thread of each process talks to MPI, the threads just compute.
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_size(MPI_COMM_WORLD, &comm_size);
 	MPI_Comm_rank(MPI_COMM_WORLD, &comm_rank);
 
-    // Check if processes are a power of 2
-    if(ceil(log2(comm_size)) != floor(log2(comm_size))){
-        printf("Processes given(%d) are not a power of 2.\n", comm_size);
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    options opt;
+    parse_options(argc, argv, &opt);
+    // A fixed seed picks the same pivots every run, so that runs can be compared.
+    // Otherwise the master's clock seeds every process alike. The selections of
+    // every process get a stream of their own.
+    if (opt.seed < 0) {
+        opt.seed = time(NULL);
+        MPI_Bcast(&opt.seed, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    }
+    seedSelection(rng_stream(opt.seed, comm_rank));
+    if (opt.threads > 0) {
+        omp_set_num_threads(opt.threads);
+    }
+    // Out of core, every process reads its own chunk of the file, a block at a time.
+    if (opt.stream != NULL) {
+        if (opt.vptree != NULL || opt.queries != NULL || opt.format != FORMAT_FLOAT) {
+            if (comm_rank == 0) {
+                printf("--stream only partitions float points around a single pivot.\n");
+            }
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        opt.load = LOAD_MPIIO;
+    }
+    // Two levels, the points of every node are pooled in the window of --load mmap.
+    if (opt.hierarchy == HIERARCHY_NODE) {
+        if (opt.stream != NULL || opt.vptree != NULL || opt.queries != NULL || opt.format != FORMAT_FLOAT) {
+            if (comm_rank == 0) {
+                printf("--hierarchy node only partitions float points around a single pivot.\n");
+            }
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        opt.load = LOAD_MMAP;
+    }
+    // Tiles only pay off on the first distance pass over every point.
+    if (opt.layout == LAYOUT_BLOCKED) {
+        if (opt.stream != NULL || opt.hierarchy == HIERARCHY_NODE || opt.vptree != NULL || opt.queries != NULL
+            || opt.format != FORMAT_FLOAT) {
+            if (comm_rank == 0) {
+                printf("--layout blocked only partitions float points around a single pivot.\n");
+            }
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
     }
 
     long *info = (long *) calloc(2, sizeof(long));
     long dims, pointsNum;
     float median;
 
+    profile prof;
+    profile_init(&prof);
+    profile_start(&prof, PHASE_IO);
+
     FILE *file;
-    if (comm_rank == 0) {
-        file = fopen("data/mnist.bin", "rb");
+    MPI_File fh;
+    shared_points shared;
+    if (opt.load == LOAD_MPIIO) {
+        mpiio_open(opt.data, &fh);
+        mpiio_dims_points(fh, info);
+    } else if (opt.load == LOAD_MMAP) {
+        shared_dims_points(opt.data, info, &shared);
+    } else {
+        if (comm_rank == 0) {
+            file = fopen(opt.data, "rb");
+            if (file == NULL) {
+                printf("Could not open %s.\n", opt.data);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        }
+        bcast_dims_points(file, info, comm_rank);
     }
-
+    profile_stop(&prof, PHASE_IO);
 
     // Assign the info[] values to new variables to make the code more coherent.
-    bcast_dims_points(file, info, comm_rank, comm_size);
+    // Every point of the file is used, the first processes get one more if they don't divide evenly.
     dims = info[0];
-    pointsNum = info[1];
+    if (info[1] < comm_size) {
+        if (comm_rank == 0) {
+            printf("There are fewer points (%ld) than processes (%d).\n", info[1], comm_size);
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    long firstPoint;
+    rankChunk(info[1], comm_size, comm_rank, &pointsNum, &firstPoint);
 
-    float *points = (float *) malloc(dims * pointsNum * sizeof(float));
+    // Mapped points need no buffer, they are a private mapping of the chunk or a part of the window.
+    float *points = NULL;
+    if (opt.load != LOAD_MMAP && opt.stream == NULL) {
+        points = (float *) malloc(dims * pointsNum * sizeof(float));
+    }
     float *pivot = (float *) malloc(dims * sizeof(float));
 
     // Make a new process struct, to pass the most important values to functions.
-    process proc = {comm_size, comm_rank, dims, pointsNum, pivot, mpi_stat101};
+    workspace ws;
+    point_format format = {FORMAT_FLOAT, dims, 1, 0, false};
+    process proc = {comm_size, comm_rank, dims, pointsNum, pivot, mpi_stat101, &opt, &ws, 0, NULL, &format, &prof,
+        MPI_COMM_WORLD};
+    // The recursion only moves the records of the points.
+    if (opt.stream != NULL) {
+        proc.dims = STREAM_RECORD_FLOATS;
+        format.mode = FORMAT_RECORD;
+    }
+    workspace_init(&ws, &proc);
+    if (comm_rank == 0) {
+        printf("Distance kernel: %s\n", distanceKernelName());
+        printf("Threads per process: %d\n", omp_get_max_threads());
+    }
+    // The deepest levels stay within a node only if the ranks of every node are contiguous.
+    if (opt.pairing == PAIRING_NODE && comm_rank == 0) {
+        bool contiguous = true;
+        for (int i = 1; i < comm_size; i++) {
+            contiguous = contiguous && ws.worldNodes[i] >= ws.worldNodes[i - 1];
+        }
+        printf("Pairing by node: %d nodes%s\n", ws.nodeCount,
+            (contiguous) ? "" : ", their ranks are interleaved, place them by core to keep the deep levels within a node");
+    }
 
     MPI_Barrier(MPI_COMM_WORLD);
 
     // Split the data from the binary file into processes.
-    split_into_processes(file, &proc, points);
+    profile_start(&prof, PHASE_IO);
+    if (opt.stream != NULL) {
+        // The file stays open, it is read once the timer starts.
+    } else if (opt.load == LOAD_MPIIO) {
+        mpiio_split_into_processes(fh, &proc, points);
+        MPI_File_close(&fh);
+    } else if (opt.load == LOAD_MMAP) {
+        shared_split_into_processes(&proc, &shared);
+        points = shared.chunk;
+    } else {
+        split_into_processes(file, &proc, points);
+    }
+    profile_stop(&prof, PHASE_IO);
 
-    
-    // Select and broadcast pivot. 
-    // Also start timing.
-    MPI_Barrier(MPI_COMM_WORLD);
-    double start = MPI_Wtime();
-    
+    // Build a vantage point tree, with the distributed splits as its top levels,
+    // and answer the k nearest neighbour queries of the input, if any.
+    if (opt.vptree != NULL) {
+        if (opt.format != FORMAT_FLOAT && comm_rank == 0) {
+            printf("The tree keeps float points, ignoring --format.\n");
+        }
+        float *distances = (float *) calloc(pointsNum, sizeof(float));
+
+        // Every point takes its index in the dataset along, for the answers to the queries.
+        float *indexed = index_points(points, &proc);
+        if (opt.load == LOAD_MMAP) {
+            unmap_points(&shared.map);
+        } else {
+            free(points);
+        }
+        points = indexed;
+        pivot = proc.pivot = (float *) realloc(pivot, proc.dims * sizeof(float));
+
+        vp_tree tree;
+        vptree_init(&tree, dims);
+        proc.tree = &tree;
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        double start = MPI_Wtime();
+
+        bcast_pivot(&proc, pivot, points);
+        partitionByPivot(points, distances, &proc);
+        vptree_build_local(&tree, points, pointsNum);
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        double end = MPI_Wtime();
+        prof.total = end - start;
+        if (comm_rank == 0) {
+            printf("\n\n Tree took %f seconds, %d distributed levels\n", end - start, tree.levels);
+        }
+        proc.tree = NULL;
+
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s%d.bin", opt.vptree, comm_rank);
+        vptree_write(&tree, filename);
+
+        if (opt.queries != NULL) {
+            FILE *in = NULL;
+            if (comm_rank == 0) {
+                in = (strcmp(opt.queries, "-") == 0) ? stdin : fopen(opt.queries, "r");
+                if (in == NULL) {
+                    printf("Could not open %s.\n", opt.queries);
+                    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+                }
+            }
+
+            float *bestDist = (float *) malloc(opt.k * sizeof(float));
+            long *bestIndex = (long *) malloc(opt.k * sizeof(long));
+
+            int query = 0;
+            while (read_query_pivot(in, &proc)) {
+                int searched = vptree_knn(&tree, pivot, opt.k, bestDist, bestIndex);
+                if (comm_rank == 0) {
+                    printf("Query %d searched %d of %d processes:", query, searched, comm_size);
+                    for (int i = 0; i < opt.k && bestIndex[i] != -1; i++) {
+                        printf(" %ld (%f)", bestIndex[i], bestDist[i]);
+                    }
+                    printf("\n");
+                }
+                query++;
+            }
+
+            if (comm_rank == 0 && in != stdin) {
+                fclose(in);
+            }
+            free(bestDist);
+            free(bestIndex);
+        }
 
-    bcast_pivot(&proc, pivot, points);
-    for(int i = 0; i < dims; i++) {
-        proc.pivot[i] = pivot[i];
+        if (opt.profile != NULL) {
+            profile_report(&prof, opt.profile, MPI_COMM_WORLD);
+        }
+        vptree_free(&tree);
+        workspace_free(&ws);
+        MPI_Finalize();
+        return 0;
     }
 
-    // Calculate the first distances from pivot and send them all to the master.
-    float *distances = (float *) calloc(pointsNum, sizeof(float));
-    float *dist_arr = NULL;
+    // Compact points are quantized once, before the first distance, so that every
+    // distance comes from the same values. Mapped points are read from a private mapping.
+    if (opt.format != FORMAT_FLOAT) {
+        format.mode = opt.format;
+        float *compact = compact_points(points, &proc);
+        if (opt.load == LOAD_MMAP) {
+            unmap_points(&shared.map);
+        } else {
+            free(points);
+        }
+        points = compact;
+        if (comm_rank == 0) {
+            printf("Points stored as %s, %ld bytes each, scale %g\n", (opt.format == FORMAT_UINT8) ? "uint8" : "fp16",
+                proc.dims * (long) sizeof(float), format.scale);
+        }
+    }
 
-    for (int i = 0; i < pointsNum; i++) {
-        distances[i] = calculateDistanceArray(points, dims * i, pivot, dims);
+    // Keep the points resident and partition them around every pivot of the input.
+    if (opt.queries != NULL) {
+        FILE *in = NULL;
+        if (comm_rank == 0) {
+            in = (strcmp(opt.queries, "-") == 0) ? stdin : fopen(opt.queries, "r");
+            if (in == NULL) {
+                printf("Could not open %s.\n", opt.queries);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        }
+
+        float *distances = (float *) calloc(pointsNum, sizeof(float));
+
+        int query = 0;
+        double total = 0;
+        while (read_query_pivot(in, &proc)) {
+            MPI_Barrier(MPI_COMM_WORLD);
+            double start = MPI_Wtime();
+
+            median = partitionByPivot(points, distances, &proc);
+
+            profile_start(&prof, PHASE_WAIT);
+            MPI_Barrier(MPI_COMM_WORLD);
+            profile_stop(&prof, PHASE_WAIT);
+            double end = MPI_Wtime();
+            total += end - start;
+            if (comm_rank == 0) {
+                printf("Query %d: median %f, took %f seconds\n", query, median, end - start);
+            }
+            query++;
+        }
+
+        if (comm_rank == 0) {
+            printf("\n\n %d queries took %f seconds\n", query, total);
+            if (in != stdin) {
+                fclose(in);
+            }
+        }
+
+        // Every phase is summed over the queries.
+        prof.total = total;
+        if (opt.profile != NULL) {
+            profile_report(&prof, opt.profile, MPI_COMM_WORLD);
+        }
+        workspace_free(&ws);
+        MPI_Finalize();
+        return 0;
     }
-    if (comm_rank == 0) {
-        dist_arr = malloc(pointsNum * comm_size * sizeof(float));
+
+    hierarchy hier;
+    if (opt.hierarchy == HIERARCHY_NODE) {
+        hierarchy_init(&hier, &proc, &shared);
     }
 
-    MPI_Gather(distances, pointsNum, MPI_FLOAT, dist_arr, pointsNum, MPI_FLOAT, 0, MPI_COMM_WORLD);
-    
-    if (comm_rank == 0) {
-        // printf("\n All distances: \n");
-        // for(int i = 0 ; i < pointsNum * comm_size ; i++){
-        //     printf("%f ", dist_arr[i]);
-        // }
+    // Stream records only exist once the chunk has been read, within the timer.
+    long pointsBefore = 0;
+    uint64_t checksumBefore = 0;
+    if (opt.verify == VERIFY_DEEP && opt.stream == NULL) {
+        verify_checksum(points, &proc, &pointsBefore, &checksumBefore);
+    }
 
-        median = quickselect(dist_arr, pointsNum * comm_size - 1);
-        //printf("\nMedian distance is %f\n\n", median);
+    if (opt.layout == LAYOUT_BLOCKED && comm_rank == 0) {
+        printf("Points stored in tiles of %d for the first distances\n", DISTANCE_TILE);
     }
 
-    // Broadcast median.
-    MPI_Bcast(&median, 1, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    // Select and broadcast pivot. 
+    // Also start timing.
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    
+
+    // The leaders partition the points of whole nodes, then every node splits its own.
+    float *distances;
+    if (opt.hierarchy == HIERARCHY_NODE) {
+        distances = hierarchy_distribute(&hier, &proc, &shared);
+    } else {
+        if (opt.stream != NULL) {
+            stream_pivot(fh, &proc);
+            points = stream_records(fh, &proc);
+            if (opt.verify == VERIFY_DEEP) {
+                verify_checksum(points, &proc, &pointsBefore, &checksumBefore);
+            }
+        } else {
+            bcast_pivot(&proc, pivot, points);
+        }
+        // Tiling is part of the run: the first distances have to make up for the copy.
+        if (opt.layout == LAYOUT_BLOCKED) {
+            profile_start(&prof, PHASE_DISTANCE);
+            tile_points(points, &proc);
+            profile_stop(&prof, PHASE_DISTANCE);
+        }
+        for(int i = 0; i < dims; i++) {
+            proc.pivot[i] = pivot[i];
+        }
+
+        // Calculate the first distances from pivot and send them all to the master.
+        distances = (float *) calloc(pointsNum, sizeof(float));
+        float *dist_arr = ws.dist_array;
 
-    // Calculate number of unwanted points and gather all data to all processes.
-    // This is the least amount of information needed to complete the transfers.
-    int *unwantedMat = (int *) malloc(comm_size * sizeof(int));
-    int *sortedByMedian = sortByMedian(distances, points, median, &proc);
+        pointDistances(points, pointsNum, distances, &proc);
+        // Find the median, either on the master or with the whole group.
+        median = findMedian(distances, dist_arr, MPI_COMM_WORLD, &proc);
 
-    int unwantedNum = sortedByMedian[0];  
+        // Calculate number of unwanted points and gather all data to all processes.
+        // This is the least amount of information needed to complete the transfers.
+        int *unwantedMat = ws.unwantedMat;
+        int *sortedByMedian = sortByMedian(distances, points, median, &proc);
 
-    MPI_Allgather(&unwantedNum, 1, MPI_INT, unwantedMat, 1, MPI_INT, MPI_COMM_WORLD);
+        splitTies(sortedByMedian, points, distances, median, unwantedMat, MPI_COMM_WORLD, &proc);
 
-    // ---------- START TESTING DISRIBUTEBYMEDIAN ---------- //
+        // ---------- START TESTING DISRIBUTEBYMEDIAN ---------- //
 
-    bool *sortedMat = (bool *) malloc(comm_size * sizeof(bool));
-    distributeByMedian(unwantedMat, points, distances, &proc, median, MPI_COMM_WORLD, sortedMat, 0);
+        distributeByMedian(unwantedMat, points, distances, &proc, median, MPI_COMM_WORLD);
+    }
     
+    // The barrier is where the processes that finished early wait for the rest.
+    profile_start(&prof, PHASE_WAIT);
     MPI_Barrier(MPI_COMM_WORLD);
+    profile_stop(&prof, PHASE_WAIT);
+    double end = MPI_Wtime();
+    prof.total = end - start;
     if (comm_rank == 0) {
-        double end = MPI_Wtime();
         printf("\n\n Distribute took %f seconds\n", end-start);
 
         char filename[20];
@@ -141,61 +421,52 @@ int main(int argc, char **argv) {
         fclose(fp);
     }
 
-    // Collect each process's minimum and maximum value, to compare them.
-    // This algorithm self-checks for correct execution.
-    float personalMin, personalMax;
-    float nextMin;
-    MPI_Win window;
-    MPI_Win_create(&personalMin, sizeof(float), sizeof(float), MPI_INFO_NULL, MPI_COMM_WORLD, &window);
-
-    // The flag a process raises if its personalMax is larger than the next personalMin.
-    bool outOfOrder = false;
-    bool totalOrder = true;
-    bool *orders = NULL;
-    if (comm_rank == 0) {
-        orders = (bool *) malloc(comm_size * sizeof(bool));
-    }
-
-    if (comm_rank == 0) {
-        personalMax = kthSmallest(distances, 0, pointsNum - 1, pointsNum - 1);
-    }
-    else if (comm_rank == comm_size - 1) {
-        personalMin = kthSmallest(distances, 0, pointsNum - 1, 0);
-    } else {
-        personalMax = kthSmallest(distances, 0, pointsNum - 1, pointsNum - 1);
-        personalMin = kthSmallest(distances, 0, pointsNum - 1, 0);
-    }
-
-    MPI_Barrier(MPI_COMM_WORLD);
-    MPI_Win_fence(0, window);
-
-    if (comm_rank != comm_size - 1) {
-        MPI_Get(&nextMin, 1, MPI_FLOAT, comm_rank + 1, 0, 1, MPI_FLOAT, window);
-    }
-
-    MPI_Win_fence(0, window);
-
-    if (comm_rank != comm_size - 1) {
-        if (personalMax > nextMin) {
-            outOfOrder = true;
+    // Every process now owns a record of each of its points, the points follow from the file.
+    if (opt.stream != NULL) {
+        double writeStart = MPI_Wtime();
+        stream_write(fh, points, opt.stream, &proc);
+        MPI_File_close(&fh);
+        MPI_Barrier(MPI_COMM_WORLD);
+        if (comm_rank == 0) {
+            printf("Writing the points to %s<rank>.bin took %f seconds\n", opt.stream, MPI_Wtime() - writeStart);
         }
     }
 
-    MPI_Gather(&outOfOrder, 1, MPI_C_BOOL, orders, 1, MPI_C_BOOL, 0, MPI_COMM_WORLD);
+    // This algorithm self-checks for correct execution: the distances of every
+    // process have to lie between those of the processes around it.
+    bool totalOrder = verify_order(distances, &proc);
     if (comm_rank == 0) {
-        for (int i = 0; i < comm_size; i++) {
-            if (orders[i]) {
-                totalOrder = false;
-                break;
-            }
-        }
-
         if(totalOrder) {
             printf("\n\nSELF CHECK HAS FOUND THE PROCESSES TO BE IN ORDER.\n\n");
         } else {
             printf("\n\nERROR ERROR ERROR ERROR ERROR.\n\n");
         }
     }
+
+    // The same points have to be there, however they moved.
+    if (opt.verify == VERIFY_DEEP) {
+        long pointsAfter;
+        uint64_t checksumAfter;
+        verify_checksum(points, &proc, &pointsAfter, &checksumAfter);
+        if (comm_rank == 0) {
+            if (pointsAfter == pointsBefore && checksumAfter == checksumBefore) {
+                printf("SELF CHECK HAS FOUND EVERY POINT IN PLACE (%ld points, checksum %016llx).\n\n",
+                    pointsAfter, (unsigned long long) checksumAfter);
+            } else {
+                printf("ERROR: %ld points with checksum %016llx before, %ld with %016llx after.\n\n",
+                    pointsBefore, (unsigned long long) checksumBefore, pointsAfter, (unsigned long long) checksumAfter);
+            }
+        }
+    }
+
+    if (opt.profile != NULL) {
+        profile_report(&prof, opt.profile, MPI_COMM_WORLD);
+    }
+
+    if (opt.hierarchy == HIERARCHY_NODE) {
+        hierarchy_free(&hier, &shared);
+    }
+    workspace_free(&ws);
     
 	MPI_Finalize();
 	return 0;
@@ -7,60 +7,1007 @@
 #include <mpi.h>
 #include <math.h>
 #include <time.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#include <omp.h>
 
 #include "headers/mpihelp.h"
 #include "headers/helpers.h"
 #include "headers/process.h"
+#include "headers/distance.h"
+#include "headers/mapfile.h"
+#include "headers/shared.h"
+#include "headers/workspace.h"
+#include "headers/vptree.h"
+#include "headers/rng.h"
+#include "headers/stream.h"
 
+// Size of each message of the pipelined exchange.
+#define PIPELINE_CHUNK_BYTES (1 << 18)
+// Bins of every round of the histogram selection.
+#define HISTOGRAM_BINS 256
+// The histogram selection gathers the last candidates once there are this few.
+#define HISTOGRAM_CANDIDATES 4096
 
-// Broadcast the dimensions of each point and how many points each process will have.
-void bcast_dims_points(FILE *file, long *info, int comm_rank, int comm_size) {
+
+// Broadcast the dimensions of each point and how many points there are in total.
+void bcast_dims_points(FILE *file, long *info, int comm_rank) {
     if (comm_rank == 0) {
         fread(info, sizeof(long), 2, file);
-
-        // Split the points evenly between each process.
-        // Only read the closest power of 2, not all of them.
-        int totalPoints = pow(2, maxPower(info[1], 2, 0));
-        info[1] = totalPoints / comm_size;
     } 
 
 	MPI_Bcast(info, 2, MPI_LONG, 0, MPI_COMM_WORLD);
 }
 
 
-// Read the binary file in easier-to-handle chunks and send them out to the processes.
-void split_into_processes(FILE *file, process *p, float *points) {
-    if (p->comm_rank == 0) {
-        // Send the first batch of floats back to master.
-        fread(points, sizeof(float), p->dims * p->pointsNum , file);
-        MPI_Sendrecv(points, p->dims * p->pointsNum, MPI_FLOAT, 0, 101, points,
-            p->dims * p->pointsNum, MPI_FLOAT, 0, 101, MPI_COMM_WORLD, p->mpi_stat101);
+// Read the binary file in easier-to-handle chunks and send them out to the processes.
+// Like MPI_Scatterv, every process gets p->ws->worldCounts of its own, in rank order.
+void split_into_processes(FILE *file, process *p, float *points) {
+    if (p->comm_rank == 0) {
+        // The first batch of floats belongs to the master.
+        fread(points, sizeof(float), p->dims * p->pointsNum , file);
+
+        // Keep reading and send to the other processes, without touching the master's chunk.
+        // The first chunks are the largest ones.
+        float *chunk = (float *) malloc(p->dims * p->ws->worldCounts[0] * sizeof(float));
+        for (int i = 1; i < p->comm_size; i++) {
+            long count = p->ws->worldCounts[i];
+            fread(chunk, sizeof(float), p->dims * count, file);
+            MPI_Send(chunk, p->dims * count, MPI_FLOAT, i, 101, MPI_COMM_WORLD);
+        }
+        free(chunk);
+    } else {
+        MPI_Recv(points, p->dims * p->pointsNum, MPI_FLOAT, 0, 101, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+
+// Open the binary file on every process, for parallel reading.
+void mpiio_open(char *filename, MPI_File *fh) {
+    // Ask for collective buffering, so that a few aggregators do the actual reading.
+    MPI_Info hints;
+    MPI_Info_create(&hints);
+    MPI_Info_set(hints, "romio_cb_read", "enable");
+    MPI_Info_set(hints, "cb_buffer_size", "16777216");
+
+    int err = MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, hints, fh);
+    MPI_Info_free(&hints);
+
+    if (err != MPI_SUCCESS) {
+        printf("Could not open %s with MPI-IO.\n", filename);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+}
+
+
+// Same as bcast_dims_points, but every process reads the two integers itself.
+void mpiio_dims_points(MPI_File fh, long *info) {
+    MPI_File_read_at_all(fh, 0, info, 2, MPI_LONG, MPI_STATUS_IGNORE);
+}
+
+
+// Every process reads its own chunk of points, right after the two integers of the header.
+void mpiio_split_into_processes(MPI_File fh, process *p, float *points) {
+    // Count whole points, so that the count does not overflow for large chunks.
+    MPI_Datatype point;
+    MPI_Type_contiguous(p->dims, MPI_FLOAT, &point);
+    MPI_Type_commit(&point);
+
+    MPI_Offset offset = 2 * sizeof(long) + (MPI_Offset) p->ws->worldOffsets[p->comm_rank] * p->dims * sizeof(float);
+    MPI_File_read_at_all(fh, offset, points, p->pointsNum, point, MPI_STATUS_IGNORE);
+
+    MPI_Type_free(&point);
+}
+
+
+// Map the file on one process per node and broadcast the dimensions and the number of points.
+void shared_dims_points(char *filename, long *info, shared_points *sh) {
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &sh->node);
+    MPI_Comm_rank(sh->node, &sh->node_rank);
+    MPI_Comm_size(sh->node, &sh->node_size);
+
+    sh->file_points = NULL;
+    sh->chunk = NULL;
+    sh->filename = filename;
+    sh->map.base = NULL;
+    sh->map.length = 0;
+    if (sh->node_rank == 0) {
+        sh->file_points = map_points(filename, &info[0], &info[1], &sh->map);
+        if (sh->file_points == NULL) {
+            printf("Could not map %s.\n", filename);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    MPI_Bcast(info, 2, MPI_LONG, 0, sh->node);
+}
+
+
+/**
+ * With --hierarchy node, the node's leader copies the chunks of every process of the
+ * node from the mapped file into one shared window, and the rest of the processes only
+ * get a pointer to their own chunk in it. Otherwise nobody needs the chunks of the
+ * others, so every process maps its own chunk privately and there is no window: the
+ * pages come from the page cache and only get copied as they are written.
+ * p->comm_rank is still the rank in MPI_COMM_WORLD here.
+ */
+void shared_split_into_processes(process *p, shared_points *sh) {
+    if (p->opt->hierarchy != HIERARCHY_NODE) {
+        unmap_points(&sh->map);
+        sh->file_points = NULL;
+        sh->chunk = map_chunk(sh->filename, p->dims, p->ws->worldOffsets[p->comm_rank], p->pointsNum, &sh->map);
+        if (sh->chunk == NULL) {
+            printf("Could not map %s.\n", sh->filename);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        MPI_Comm_free(&sh->node);
+        return;
+    }
+
+    // Which chunk of the file each process of the node owns.
+    int *worldRanks = (int *) malloc(sh->node_size * sizeof(int));
+    MPI_Allgather(&p->comm_rank, 1, MPI_INT, worldRanks, 1, MPI_INT, sh->node);
+
+    // The chunks are laid out in the order of the node's ranks.
+    long nodePoints = 0, myStart = 0;
+    for (int i = 0; i < sh->node_size; i++) {
+        if (i == sh->node_rank) {
+            myStart = nodePoints;
+        }
+        nodePoints += p->ws->worldCounts[worldRanks[i]];
+    }
+    MPI_Aint size = (sh->node_rank == 0) ? (MPI_Aint) nodePoints * p->dims * sizeof(float) : 0;
+
+    float *base;
+    MPI_Win_allocate_shared(size, sizeof(float), MPI_INFO_NULL, sh->node, &base, &sh->win);
+
+    int disp_unit;
+    MPI_Win_shared_query(sh->win, 0, &size, &disp_unit, &base);
+
+    MPI_Win_fence(0, sh->win);
+    if (sh->node_rank == 0) {
+        long pos = 0;
+        for (int i = 0; i < sh->node_size; i++) {
+            long count = p->ws->worldCounts[worldRanks[i]];
+            memcpy(&base[pos * p->dims], &sh->file_points[p->ws->worldOffsets[worldRanks[i]] * p->dims],
+                count * p->dims * sizeof(float));
+            pos += count;
+        }
+        unmap_points(&sh->map);
+        sh->file_points = NULL;
+    }
+    MPI_Win_fence(0, sh->win);
+
+    sh->chunk = &base[myStart * p->dims];
+    free(worldRanks);
+}
+
+
+
+// Stores the features floats of in as a compact point at out, in the format of the run.
+void quantize_point(const float *in, float *out, process *p) {
+    point_format *f = p->format;
+
+    if (f->mode == FORMAT_UINT8) {
+        unsigned char *q = (unsigned char *) out;
+        for (long i = 0; i < f->features; i++) {
+            float v = roundf((in[i] - f->offset) / f->scale);
+            q[i] = (v < 0) ? 0 : (v > 255) ? 255 : (unsigned char) v;
+        }
+    } else {
+        unsigned short *h = (unsigned short *) out;
+        for (long i = 0; i < f->features; i++) {
+            h[i] = floatToHalf((in[i] - f->offset) / f->scale);
+        }
+    }
+}
+
+
+// How many points fit in a chunk of the pipelined exchange.
+long pipelineChunkPoints(process *p) {
+    long chunk = PIPELINE_CHUNK_BYTES / (p->dims * sizeof(float));
+    return (chunk > 0) ? chunk : 1;
+}
+
+
+// Resizes the buffers of the workspace that hold whole points, once p->dims changes.
+static void resizePoints(process *p) {
+    workspace *ws = p->ws;
+    MPI_Type_free(&ws->point);
+    MPI_Type_contiguous(p->dims, MPI_FLOAT, &ws->point);
+    MPI_Type_commit(&ws->point);
+
+    if (ws->row != NULL) {
+        ws->row = (float *) realloc(ws->row, p->dims * sizeof(float));
+    }
+    // Chunks hold a different number of points now.
+    if (ws->buffers != NULL) {
+        free(ws->buffers);
+        ws->buffers = (float *) malloc(2 * pipelineChunkPoints(p) * (p->dims + 1) * sizeof(float));
+    }
+}
+
+
+/**
+ * Returns compact copies of the float points, in the format of the run.
+ * The offset and the scale come from the range of the whole dataset, so that distances
+ * stay comparable between processes. Each point is padded to whole floats, which
+ * p->dims counts from now on.
+ */
+float *compact_points(float *points, process *p) {
+    point_format *f = p->format;
+    long features = p->dims;
+
+    // The minimum and the negated maximum, so that a single reduction finds both.
+    float range[2] = {FLT_MAX, FLT_MAX};
+    for (long i = 0; i < p->pointsNum * features; i++) {
+        if (points[i] < range[0]) {
+            range[0] = points[i];
+        }
+        if (-points[i] < range[1]) {
+            range[1] = -points[i];
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, range, 2, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
+
+    // uint8 spreads the range over 0...255, fp16 over 0...1.
+    float width = -range[1] - range[0];
+    f->features = features;
+    f->offset = range[0];
+    f->scale = (width > 0) ? width / ((f->mode == FORMAT_UINT8) ? 255 : 1) : 1;
+
+    long bytes = features * ((f->mode == FORMAT_UINT8) ? sizeof(unsigned char) : sizeof(unsigned short));
+    long words = (bytes + sizeof(float) - 1) / sizeof(float);
+    float *compact = (float *) calloc(p->pointsNum * words, sizeof(float));
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < p->pointsNum; i++) {
+        quantize_point(&points[i * features], &compact[i * words], p);
+    }
+
+    p->dims = words;
+    resizePoints(p);
+
+    return compact;
+}
+
+
+/**
+ * Returns copies of the points, each one followed by its index in the dataset, in
+ * VP_ID_FLOATS floats, so that the index moves wherever the point does. p->dims
+ * counts those floats too from now on, the coordinates are p->format->features.
+ */
+float *index_points(float *points, process *p) {
+    long features = p->dims;
+    long dims = features + VP_ID_FLOATS;
+    long first = p->ws->worldOffsets[p->comm_rank];
+    float *indexed = (float *) malloc(p->pointsNum * dims * sizeof(float));
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < p->pointsNum; i++) {
+        long index = first + i;
+        memcpy(&indexed[i * dims], &points[i * features], features * sizeof(float));
+        memcpy(&indexed[i * dims + features], &index, sizeof(long));
+    }
+
+    p->format->features = features;
+    p->dims = dims;
+    resizePoints(p);
+
+    return indexed;
+}
+
+
+/**
+ * Copies the float points to tiles of DISTANCE_TILE points, for the first distances.
+ * The points themselves are kept, the pivot comes from them and the first partition
+ * writes every point there, straight out of its tile.
+ */
+void tile_points(float *points, process *p) {
+    p->ws->tiles = (float *) malloc(tiledFloats(p->pointsNum, p->dims) * sizeof(float));
+    tilePoints(points, p->pointsNum, p->dims, p->ws->tiles);
+    p->format->tiled = true;
+}
+
+
+// Distances of n points from p->pivot, with the kernel of the points' format.
+void pointDistances(float *points, long n, float *out, process *p) {
+    point_format *f = p->format;
+    float scale2 = f->scale * f->scale;
+    profile_start(p->prof, PHASE_DISTANCE);
+
+    if (f->mode == FORMAT_UINT8) {
+        distancesBatchU8((unsigned char *) points, n, p->dims * sizeof(float), f->features,
+            (unsigned char *) p->pivot, scale2, out);
+    } else if (f->mode == FORMAT_FP16) {
+        distancesBatchF16((unsigned short *) points, n, p->dims * sizeof(float) / sizeof(unsigned short),
+            f->features, (unsigned short *) p->pivot, scale2, out);
+    } else if (f->tiled) {
+        // Tiles only hold every point of the process, so nobody asks for fewer.
+        distancesTiled(p->ws->tiles, n, p->dims, p->pivot, out);
+    } else if (f->mode == FORMAT_RECORD) {
+        // The records of --stream keep the distance from the only pivot of the run.
+        for (long i = 0; i < n; i++) {
+            out[i] = ((stream_record *) points)[i].dist;
+        }
+    } else {
+        // Points of the vantage point tree carry their index after the coordinates.
+        distancesBatchStrided(points, n, p->dims, f->features, p->pivot, out);
+    }
+    profile_stop(p->prof, PHASE_DISTANCE);
+}
+
+
+/**
+ * Allocates every buffer the recursion will need, for the options of the run.
+ * Groups only get smaller, so everything is sized for p->world.
+ */
+void workspace_init(workspace *ws, process *p) {
+    rng_seed(&ws->pivots, p->opt->seed);
+    for (int i = 0; i < MAX_LEVELS; i++) {
+        ws->comms[i] = MPI_COMM_NULL;
+    }
+
+    ws->worldCounts = (long *) malloc(p->comm_size * sizeof(long));
+    ws->worldOffsets = (long *) malloc(p->comm_size * sizeof(long));
+    MPI_Allgather(&p->pointsNum, 1, MPI_LONG, ws->worldCounts, 1, MPI_LONG, p->world);
+    long offset = 0;
+    for (int i = 0; i < p->comm_size; i++) {
+        ws->worldOffsets[i] = offset;
+        offset += ws->worldCounts[i];
+    }
+    MPI_Type_contiguous(p->dims, MPI_FLOAT, &ws->point);
+    MPI_Type_commit(&ws->point);
+
+    ws->groupCounts = (int *) malloc(p->comm_size * sizeof(int));
+    ws->groupDispls = (int *) malloc(p->comm_size * sizeof(int));
+
+    ws->unwantedMat = (int *) malloc(p->comm_size * sizeof(int));
+    ws->tieCounts = (int *) malloc(3 * p->comm_size * sizeof(int));
+
+    ws->dist_array = NULL;
+    long largest = p->pointsNum;
+    if (p->opt->select == SELECT_GATHER) {
+        // Follow the splits down to the first group this process is the master of,
+        // the largest one it will gather. Otherwise it only gathers its own points.
+        int lo = 0, hi = p->comm_size;
+        while (hi - lo > 1) {
+            if (lo == p->comm_rank) {
+                largest = ws->worldOffsets[hi - 1] + ws->worldCounts[hi - 1] - ws->worldOffsets[lo];
+                break;
+            }
+            int mid = lo + (hi - lo) / 2;
+            if (p->comm_rank < mid) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
+        }
+        ws->dist_array = (float *) malloc(largest * sizeof(float));
+    }
+
+    ws->scratchDist = NULL;
+    ws->selectScratch = NULL;
+    ws->threadCounts = NULL;
+    if (p->opt->threads > 1 && ws->dist_array != NULL) {
+        ws->selectScratch = (float *) malloc(largest * sizeof(float));
+    }
+    if (p->opt->layout == LAYOUT_BLOCKED) {
+        ws->scratchDist = (float *) malloc(p->pointsNum * sizeof(float));
+    }
+    if (p->opt->threads > 1 || p->opt->layout == LAYOUT_BLOCKED) {
+        // The leaders of --hierarchy node only set their threads once the recursion starts.
+        int threads = (p->opt->threads > omp_get_max_threads()) ? p->opt->threads : omp_get_max_threads();
+        ws->threadCounts = (long *) malloc(3 * (threads + 1) * sizeof(long));
+    }
+    ws->tiles = NULL;
+
+    ws->work = NULL;
+    ws->weighted = NULL;
+    if (p->opt->select == SELECT_DISTRIBUTED) {
+        ws->work = (float *) malloc(p->pointsNum * sizeof(float));
+        ws->weighted = (double *) malloc(2 * p->comm_size * sizeof(double));
+    }
+
+    ws->histogram = NULL;
+    ws->candidates = NULL;
+    if (p->opt->select == SELECT_HISTOGRAM) {
+        ws->work = (float *) malloc(p->pointsNum * sizeof(float));
+        ws->histogram = (long *) malloc(2 * HISTOGRAM_BINS * sizeof(long));
+        ws->candidates = (float *) malloc(HISTOGRAM_CANDIDATES * sizeof(float));
+    }
+
+    // The pivots are chosen before the median of their level, so they share its buffer.
+    if (p->opt->pivot == PIVOT_FARTHEST && ws->work == NULL) {
+        ws->work = (float *) malloc(p->pointsNum * sizeof(float));
+    }
+    ws->sums = NULL;
+    if (p->opt->pivot == PIVOT_VARIANCE) {
+        ws->sums = (double *) malloc(2 * p->format->features * sizeof(double));
+    }
+
+    ws->pairs = NULL;
+    ws->perm = NULL;
+    ws->row = NULL;
+    if (p->opt->partition == PARTITION_INDEX) {
+        ws->pairs = (dist_index *) malloc(p->pointsNum * sizeof(dist_index));
+        ws->perm = (long *) malloc(p->pointsNum * sizeof(long));
+        ws->row = (float *) malloc(p->dims * sizeof(float));
+    }
+
+    ws->buffers = NULL;
+    if (p->opt->exchange == EXCHANGE_PIPELINE) {
+        // Every chunk may carry the distances of its points too.
+        ws->buffers = (float *) malloc(2 * pipelineChunkPoints(p) * (p->dims + 1) * sizeof(float));
+    }
+
+    // Which node every process is on, named after the first process of the node.
+    ws->worldNodes = (int *) calloc(p->comm_size, sizeof(int));
+    ws->nodeCount = 1;
+    if (p->opt->pairing == PAIRING_NODE) {
+        MPI_Comm node;
+        MPI_Comm_split_type(p->world, MPI_COMM_TYPE_SHARED, p->comm_rank, MPI_INFO_NULL, &node);
+        int first = p->comm_rank;
+        MPI_Allreduce(MPI_IN_PLACE, &first, 1, MPI_INT, MPI_MIN, node);
+        MPI_Comm_free(&node);
+        MPI_Allgather(&first, 1, MPI_INT, ws->worldNodes, 1, MPI_INT, p->world);
+
+        // Number the nodes in the order of their first processes.
+        int *number = (int *) malloc(p->comm_size * sizeof(int));
+        ws->nodeCount = 0;
+        for (int i = 0; i < p->comm_size; i++) {
+            if (ws->worldNodes[i] == i) {
+                number[i] = ws->nodeCount++;
+            }
+            ws->worldNodes[i] = number[ws->worldNodes[i]];
+        }
+        free(number);
+    }
+    ws->groupNodes = (int *) malloc(p->comm_size * sizeof(int));
+    ws->nodeOrder = (int *) malloc(p->comm_size * sizeof(int));
+    ws->nodeSums = (long *) malloc(4 * ws->nodeCount * sizeof(long));
+
+    ws->tailStart = NULL;
+    ws->counts = NULL;
+    ws->zeros = NULL;
+    ws->types = NULL;
+    if (p->opt->exchange == EXCHANGE_ALLTOALL) {
+        ws->tailStart = (long *) malloc(p->comm_size * sizeof(long));
+        ws->counts = (int *) calloc(p->comm_size, sizeof(int));
+        ws->zeros = (int *) calloc(p->comm_size, sizeof(int));
+        ws->types = (MPI_Datatype *) malloc(p->comm_size * sizeof(MPI_Datatype));
+    }
+}
+
+
+void workspace_free(workspace *ws) {
+    for (int i = 0; i < MAX_LEVELS; i++) {
+        if (ws->comms[i] != MPI_COMM_NULL) {
+            MPI_Comm_free(&ws->comms[i]);
+        }
+    }
+
+    MPI_Type_free(&ws->point);
+    free(ws->worldCounts);
+    free(ws->worldOffsets);
+    free(ws->groupCounts);
+    free(ws->groupDispls);
+    free(ws->unwantedMat);
+    free(ws->tieCounts);
+    free(ws->dist_array);
+    free(ws->scratchDist);
+    free(ws->tiles);
+    free(ws->selectScratch);
+    free(ws->threadCounts);
+    free(ws->work);
+    free(ws->weighted);
+    free(ws->sums);
+    free(ws->histogram);
+    free(ws->candidates);
+    free(ws->pairs);
+    free(ws->perm);
+    free(ws->row);
+    free(ws->buffers);
+    free(ws->tailStart);
+    free(ws->counts);
+    free(ws->zeros);
+    free(ws->types);
+    free(ws->worldNodes);
+    free(ws->groupNodes);
+    free(ws->nodeOrder);
+    free(ws->nodeSums);
+}
+
+
+/**
+ * The master reads the next pivot, dims numbers on a single line, and broadcasts it.
+ * Lines that do not hold a whole pivot are skipped.
+ * Returns false once the input is over.
+ */
+bool read_query_pivot(FILE *in, process *p) {
+    int more = 0;
+    int world_rank;
+    MPI_Comm_rank(p->world, &world_rank);
+
+    if (world_rank == 0) {
+        char *line = NULL;
+        size_t cap = 0;
+        long features = p->format->features;
+        float *values = (float *) malloc(features * sizeof(float));
+
+        while (!more && getline(&line, &cap, in) != -1) {
+            char *cursor = line, *end;
+            long read = 0;
+            for (; read < features; read++) {
+                values[read] = strtof(cursor, &end);
+                if (end == cursor) {
+                    break;
+                }
+                cursor = end;
+            }
+
+            if (read == features) {
+                more = 1;
+            } else if (read > 0) {
+                printf("Skipping a pivot with %ld instead of %ld values.\n", read, features);
+            }
+        }
+
+        // Compact points are compared against a compact pivot.
+        if (more && p->format->mode != FORMAT_FLOAT) {
+            quantize_point(values, p->pivot, p);
+        } else if (more) {
+            memcpy(p->pivot, values, features * sizeof(float));
+        }
+        free(values);
+        free(line);
+    }
+
+    MPI_Bcast(&more, 1, MPI_INT, 0, p->world);
+    if (more) {
+        MPI_Bcast(p->pivot, p->dims, MPI_FLOAT, 0, p->world);
+    }
+
+    return more;
+}
+
+
+// The owner copies its point to p->pivot and broadcasts it to the group.
+static void bcastOwnedPivot(float *points, int owner, long index, MPI_Comm comm, process *p) {
+    if (p->comm_rank == owner) {
+        memcpy(p->pivot, &points[index * p->dims], p->dims * sizeof(float));
+    }
+    MPI_Bcast(p->pivot, p->dims, MPI_FLOAT, owner, comm);
+}
+
+
+/**
+ * Draws a point uniformly from every point of the group. Every process draws the same
+ * number from the shared stream of the pivots, so only the point itself is sent.
+ * Writes the owner and its index to owner and index.
+ */
+static void randomPivot(float *points, MPI_Comm comm, process *p, int *owner, long *index) {
+    int count = p->pointsNum;
+    int *counts = p->ws->groupCounts;
+    MPI_Allgather(&count, 1, MPI_INT, counts, 1, MPI_INT, comm);
+
+    long total = 0;
+    for (int i = 0; i < p->comm_size; i++) {
+        total += counts[i];
+    }
+    long global = rng_below(&p->ws->pivots, total);
+
+    *owner = 0;
+    while (global >= counts[*owner]) {
+        global -= counts[*owner];
+        (*owner)++;
+    }
+    *index = global;
+    bcastOwnedPivot(points, *owner, *index, comm, p);
+}
+
+
+// The point farthest from a random one. Every process scans its own points.
+static void farthestPivot(float *points, MPI_Comm comm, process *p, int *owner, long *index) {
+    randomPivot(points, comm, p, owner, index);
+
+    float *distances = p->ws->work;
+    pointDistances(points, p->pointsNum, distances, p);
+    struct {
+        float dist;
+        int rank;
+    } local = {-1, p->comm_rank}, farthest;
+    long localIndex = 0;
+    for (long i = 0; i < p->pointsNum; i++) {
+        if (distances[i] > local.dist) {
+            local.dist = distances[i];
+            localIndex = i;
+        }
+    }
+
+    MPI_Allreduce(&local, &farthest, 1, MPI_FLOAT_INT, MPI_MAXLOC, comm);
+    *owner = farthest.rank;
+    *index = localIndex;
+    bcastOwnedPivot(points, *owner, *index, comm, p);
+}
+
+
+// Coordinate j of point i, in the units of the points' format.
+static inline float pointCoordinate(float *points, long i, long j, process *p) {
+    if (p->format->mode == FORMAT_UINT8) {
+        return ((unsigned char *) &points[i * p->dims])[j];
+    } else if (p->format->mode == FORMAT_FP16) {
+        return halfToFloat(((unsigned short *) &points[i * p->dims])[j]);
+    }
+    return points[i * p->dims + j];
+}
+
+
+/**
+ * The point with the smallest value along the dimension the group varies the most in.
+ * The sums and the sums of squares of every dimension are reduced over the threads and
+ * then over the group. Compact formats share one scale, so their variances compare alike.
+ */
+static void variancePivot(float *points, MPI_Comm comm, process *p, int *owner, long *index) {
+    long features = p->format->features;
+    double *sums = p->ws->sums;
+    memset(sums, 0, 2 * features * sizeof(double));
+    double *squares = &sums[features];
+    long n = p->pointsNum;
+
+    #pragma omp parallel for reduction(+:sums[:2 * features]) schedule(static)
+    for (long i = 0; i < n; i++) {
+        for (long j = 0; j < features; j++) {
+            double value = pointCoordinate(points, i, j, p);
+            sums[j] += value;
+            sums[features + j] += value * value;
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, sums, 2 * features, MPI_DOUBLE, MPI_SUM, comm);
+
+    long total = n;
+    MPI_Allreduce(MPI_IN_PLACE, &total, 1, MPI_LONG, MPI_SUM, comm);
+    long widest = 0;
+    double widestVariance = -1;
+    for (long j = 0; j < features; j++) {
+        double mean = sums[j] / total;
+        double variance = squares[j] / total - mean * mean;
+        if (variance > widestVariance) {
+            widestVariance = variance;
+            widest = j;
+        }
+    }
+
+    struct {
+        float value;
+        int rank;
+    } local = {FLT_MAX, p->comm_rank}, smallest;
+    long localIndex = 0;
+    for (long i = 0; i < n; i++) {
+        float value = pointCoordinate(points, i, widest, p);
+        if (value < local.value) {
+            local.value = value;
+            localIndex = i;
+        }
+    }
+
+    MPI_Allreduce(&local, &smallest, 1, MPI_FLOAT_INT, MPI_MINLOC, comm);
+    *owner = smallest.rank;
+    *index = localIndex;
+    bcastOwnedPivot(points, *owner, *index, comm, p);
+}
+
+
+// Picks the pivot of the group with the policy of the run and writes it to p->pivot.
+// Returns the process that owns it, -1 if it came from a file.
+static int choosePivot(float *points, MPI_Comm comm, process *p, long *index) {
+    int owner = -1;
+    *index = -1;
+
+    if (p->opt->pivot == PIVOT_FARTHEST) {
+        farthestPivot(points, comm, p, &owner, index);
+    } else if (p->opt->pivot == PIVOT_VARIANCE) {
+        variancePivot(points, comm, p, &owner, index);
+    } else {
+        randomPivot(points, comm, p, &owner, index);
+    }
+
+    return owner;
+}
+
+
+// Picks the first pivot of the world with the policy of the run and broadcasts it.
+void bcast_pivot(process *p, float *pivot, float *points) {
+    long index = -1;
+    int owner = -1;
+
+    if (p->opt->pivot == PIVOT_USER) {
+        FILE *in = NULL;
+        if (p->comm_rank == 0) {
+            in = fopen(p->opt->pivotFile, "r");
+            if (in == NULL) {
+                printf("Could not open %s.\n", p->opt->pivotFile);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        }
+        if (!read_query_pivot(in, p)) {
+            if (p->comm_rank == 0) {
+                printf("%s holds no pivot.\n", p->opt->pivotFile);
+            }
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        if (p->comm_rank == 0) {
+            fclose(in);
+        }
+    } else {
+        owner = choosePivot(points, p->world, p, &index);
+    }
+
+    if (pivot != p->pivot) {
+        memcpy(pivot, p->pivot, p->dims * sizeof(float));
+    }
+    if (p->comm_rank == owner) {
+        printf("Pivot index is %ld of process %d\n", index, owner);
+    }
+}
+
+
+// Picks the next pivot of the group. Pivots from a file only apply to the first one.
+void bcast_group_pivot(float *points, MPI_Comm comm, process *p) {
+    long index;
+    choosePivot(points, comm, p, &index);
+}
+
+
+/**
+ * Same layout as sortByMedian: wanted points first, then the unwanted ones
+ * and the points equal to the median last. Only the compact (distance, index)
+ * pairs are swapped while partitioning. The points are moved once at the end,
+ * each one straight to its final place.
+ */
+int *sortByMedianIndexed(float *array, float *points, float median, process *p) {
+    // Multiply by -1 if the process is looking for small elements to send out.
+    int right_half = (p->comm_rank + 1 > p->comm_size / 2) ? -1 : 1; 
+
+    dist_index *pairs = p->ws->pairs;
+    for (long i = 0; i < p->pointsNum; i++) {
+        pairs[i].dist = array[i];
+        pairs[i].index = i;
+    }
+
+    // Three-way partition of the pairs: [0, left) wanted, [left, right) median,
+    // [right, pointsNum) unwanted. The two last parts are flipped afterwards.
+    long left = 0, i = 0, right = p->pointsNum;
+    while (i < right) {
+        if (right_half * pairs[i].dist < right_half * median) {
+            dist_index temp = pairs[i]; pairs[i] = pairs[left]; pairs[left] = temp;
+            left++;
+            i++;
+        } else if (right_half * pairs[i].dist > right_half * median) {
+            right--;
+            dist_index temp = pairs[i]; pairs[i] = pairs[right]; pairs[right] = temp;
+        } else {
+            i++;
+        }
+    }
+    long medians = right - left;
+
+    // Write the distances and the permutation in their final order.
+    long *perm = p->ws->perm;
+    long pos = 0;
+    for (long j = 0; j < left; j++, pos++) {
+        array[pos] = pairs[j].dist;
+        perm[pos] = pairs[j].index;
+    }
+    for (long j = right; j < p->pointsNum; j++, pos++) {
+        array[pos] = pairs[j].dist;
+        perm[pos] = pairs[j].index;
+    }
+    for (long j = left; j < right; j++, pos++) {
+        array[pos] = pairs[j].dist;
+        perm[pos] = pairs[j].index;
+    }
+
+    permuteChunks(points, perm, p->pointsNum, p->dims, p->ws->row);
+
+    int *result = p->ws->sorted;
+    result[0] = p->pointsNum - left;
+    result[1] = medians;
+    result[2] = (medians) ? left : -1;
+
+    return result;
+}
+
+
+// 0 for wanted points, 1 for unwanted ones and 2 for medians.
+static int medianClass(float distance, float median, int right_half) {
+    float d = right_half * distance;
+    return (d < right_half * median) ? 0 : (d > right_half * median) ? 1 : 2;
+}
+
+
+/**
+ * Where the j-th misplaced point of partitionClass is: the j-th one of another class
+ * before split if before is set, the j-th one of the class after split otherwise.
+ * Every block is partitioned already, so its misplaced points are contiguous, up to *end.
+ */
+static long misplacedPoint(long j, long left, long n, long split, long *counts, int threads, bool before,
+    long *end)
+{
+    for (int b = 0; b < threads; b++) {
+        long start = left + n * b / threads, stop = left + n * (b + 1) / threads;
+        long mid = start + counts[b];
+        long lo = (before) ? mid : (split > start) ? split : start;
+        long hi = (before) ? ((split < stop) ? split : stop) : mid;
+        if (hi <= lo) {
+            continue;
+        }
+        if (j < hi - lo) {
+            *end = hi;
+            return lo + j;
+        }
+        j -= hi - lo;
+    }
+
+    return -1;
+}
+
+
+/**
+ * Moves the points of [left, right) whose class is c before the rest, in place, on the
+ * thread team, and returns how many there are. Each thread partitions its own block,
+ * then the points left on the wrong side of the split are paired up and swapped, every
+ * thread taking an equal share of the pairs.
+ */
+static long partitionClass(float *array, float *points, long left, long right, int c, float median, process *p) {
+    // Multiply by -1 if the process is looking for small elements to send out.
+    int right_half = (p->comm_rank + 1 > p->comm_size / 2) ? -1 : 1;
+
+    long dims = p->dims, n = right - left;
+    long *counts = p->ws->threadCounts;
+    long total = 0;
+
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        int threads = omp_get_num_threads();
+        long start = left + n * t / threads, end = left + n * (t + 1) / threads;
+
+        long mid = start;
+        for (long i = start; i < end; i++) {
+            if (medianClass(array[i], median, right_half) == c) {
+                if (i != mid) {
+                    swapFloat(array, i, mid, 1);
+                    swapFloat(points, i * dims, mid * dims, dims);
+                }
+                mid++;
+            }
+        }
+        counts[t] = mid - start;
+
+        #pragma omp barrier
+        long split = left;
+        for (int b = 0; b < threads; b++) {
+            split += counts[b];
+        }
+        // As many points of other classes sit before the split as points of the class after it.
+        long misplaced = 0;
+        for (int b = 0; b < threads; b++) {
+            long stop = left + n * (b + 1) / threads;
+            long first = left + n * b / threads + counts[b];
+            long last = (split < stop) ? split : stop;
+            misplaced += (last > first) ? last - first : 0;
+        }
+
+        long j = misplaced * t / threads, jEnd = misplaced * (t + 1) / threads;
+        if (j < jEnd) {
+            long xEnd, yEnd;
+            long x = misplacedPoint(j, left, n, split, counts, threads, true, &xEnd);
+            long y = misplacedPoint(j, left, n, split, counts, threads, false, &yEnd);
+            for (; j < jEnd; j++) {
+                swapFloat(array, x, y, 1);
+                swapFloat(points, x * dims, y * dims, dims);
+                if (++x == xEnd && j + 1 < jEnd) {
+                    x = misplacedPoint(j + 1, left, n, split, counts, threads, true, &xEnd);
+                }
+                if (++y == yEnd && j + 1 < jEnd) {
+                    y = misplacedPoint(j + 1, left, n, split, counts, threads, false, &yEnd);
+                }
+            }
+        }
+
+        if (t == 0) {
+            total = split - left;
+        }
+    }
+
+    return total;
+}
+
+
+/**
+ * Same layout as sortByMedianSwap, for tiled points. Each thread counts the wanted,
+ * unwanted and median points of its own block, so that it knows where each of them
+ * goes, and copies them out of their tiles straight to their place among the rows.
+ * Their distances go through the scratch buffer and are copied back in parallel.
+ */
+static void untileByMedian(float *array, float *points, float median, long *totals, process *p) {
+    // Multiply by -1 if the process is looking for small elements to send out.
+    int right_half = (p->comm_rank + 1 > p->comm_size / 2) ? -1 : 1;
+
+    long dims = p->dims;
+    float *newArray = p->ws->scratchDist;
+    long *counts = p->ws->threadCounts;
+    memset(counts, 0, 3 * (omp_get_max_threads() + 1) * sizeof(long));
+
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        int threads = omp_get_num_threads();
+        long start = p->pointsNum * t / threads, end = p->pointsNum * (t + 1) / threads;
+
+        long *mine = &counts[3 * (t + 1)];
+        for (long i = start; i < end; i++) {
+            mine[medianClass(array[i], median, right_half)]++;
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (int i = 1; i <= threads; i++) {
+                for (int c = 0; c < 3; c++) {
+                    totals[c] += counts[3 * i + c];
+                }
+            }
+            // Turn the counts into the position each thread writes its first point of each kind.
+            long classStart[3] = {0, totals[0], totals[0] + totals[1]};
+            for (int i = 1; i <= threads; i++) {
+                for (int c = 0; c < 3; c++) {
+                    long count = counts[3 * i + c];
+                    counts[3 * i + c] = classStart[c];
+                    classStart[c] += count;
+                }
+            }
+        }
 
-        // Keep reading and send to the other processes.
-        for (int i = 1; i < p->comm_size; i++) {
-            fread(points, sizeof(float), p->dims * p->pointsNum , file);
-            MPI_Send(points, p->dims * p->pointsNum, MPI_FLOAT, i, 101, MPI_COMM_WORLD);
+        for (long i = start; i < end; i++) {
+            long pos = mine[medianClass(array[i], median, right_half)]++;
+            newArray[pos] = array[i];
+            untilePoint(p->ws->tiles, i, dims, &points[pos * dims]);
         }
-    } else {
-        MPI_Recv(points, p->dims * p->pointsNum, MPI_FLOAT, 0, 101, MPI_COMM_WORLD, p->mpi_stat101);
+
+        #pragma omp barrier
+        memcpy(&array[start], &newArray[start], (end - start) * sizeof(float));
     }
+
+    free(p->ws->tiles);
+    p->ws->tiles = NULL;
+    p->format->tiled = false;
 }
 
 
-// Let the master select and broadcast the pivot point.
-void bcast_pivot(process *p, float *pivot, float *points) {
+/**
+ * Same layout as sortByMedianSwap, built by the thread team, in place: the wanted
+ * points are moved in front of the rest, then the unwanted ones in front of the
+ * medians. Tiled points are copied out of their tiles instead.
+ */
+int *sortByMedianParallel(float *array, float *points, float median, process *p) {
+    long totals[3] = {0, 0, 0};
+    if (p->format->tiled) {
+        untileByMedian(array, points, median, totals, p);
+    } else {
+        totals[0] = partitionClass(array, points, 0, p->pointsNum, 0, median, p);
+        totals[1] = partitionClass(array, points, totals[0], p->pointsNum, 1, median, p);
+        totals[2] = p->pointsNum - totals[0] - totals[1];
+    }
 
-    // Pick a pivot and broadcast it 
-    if (p->comm_rank == 0) {
-        int pivotIndex = rand() % p->pointsNum;
-        // int pivotIndex = 238; // check for indices that are known to have broken the algo.
-        printf("Pivot index is %d\n", pivotIndex);
+    int *result = p->ws->sorted;
+    result[0] = p->pointsNum - totals[0];
+    result[1] = totals[2];
+    result[2] = (totals[2]) ? totals[0] : -1;
 
-        for (int i = 0; i < p->dims; i++) {
-            pivot[i] = points[i + pivotIndex * p->dims];
-		}  
-    }
-    MPI_Bcast(pivot, p->dims, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    return result;
 }
 
 
@@ -75,7 +1022,7 @@ void bcast_pivot(process *p, float *pivot, float *points) {
  * greater values first.
  */ 
 
-int *sortByMedian(float *array, float *points, float median, process *p) {
+int *sortByMedianSwap(float *array, float *points, float median, process *p) {
     // Multiply by -1 if the process is looking for small elements to send out.
     int right_half = (p->comm_rank + 1 > p->comm_size / 2) ? -1 : 1; 
 
@@ -98,8 +1045,9 @@ int *sortByMedian(float *array, float *points, float median, process *p) {
         }
         else if (right_half * array[i] > right_half * median) {
             // Only do the swap if value doesn't belong in the
-            // rightmost set.
-            if (right_half * array[right - 1] < right_half * median) {
+            // rightmost set. Medians are swapped out too, so that
+            // the rightmost set only holds strictly unwanted values.
+            if (right_half * array[right - 1] <= right_half * median) {
                 swapFloat(array, i, right - 1, 1);
                 swapFloat(points, i * p->dims, (right - 1) * p->dims, p->dims);
             }
@@ -112,20 +1060,13 @@ int *sortByMedian(float *array, float *points, float median, process *p) {
         }
     }
 
-    // Swap the last median with the last right 
-    // Just a playa playing
-    if (center + 1 - left != 0) {
-        printf("dist[right-1] = %f\n", array[right-1]);
-        printf("median = %f\n", median);
-    }
-
     // Gradually shift every median to the end.
     for (int i = 0 ; i < center + 1 - left; i++) {
         swapFloat(array, p->pointsNum - i - 1, right - i - 1, 1);
         swapFloat(points, (p->pointsNum - i - 1) * p->dims, (right - i - 1) * p->dims, p->dims);
     }
 
-    int *result = (int *) malloc(3 * sizeof(int));
+    int *result = p->ws->sorted;
     // Return the number of unwanted points, aka unwantedNum.
     // Also including elements that are equal to the median for now.
     result[0] = p->pointsNum - left;
@@ -138,6 +1079,295 @@ int *sortByMedian(float *array, float *points, float median, process *p) {
 }
 
 
+// Partitions the points with the threads, or as --partition says.
+// Tiled points take the copy of the threads, on any number of them.
+int *sortByMedian(float *array, float *points, float median, process *p) {
+    int *result;
+
+    profile_start(p->prof, PHASE_PARTITION);
+    if (p->opt->threads > 1 || p->format->tiled) {
+        result = sortByMedianParallel(array, points, median, p);
+    } else if (p->opt->partition == PARTITION_INDEX) {
+        result = sortByMedianIndexed(array, points, median, p);
+    } else {
+        result = sortByMedianSwap(array, points, median, p);
+    }
+    profile_stop(p->prof, PHASE_PARTITION);
+
+    return result;
+}
+
+
+// Orders (median, weight) pairs by their median.
+static int compareWeighted(const void *a, const void *b) {
+    double x = ((const double *) a)[0];
+    double y = ((const double *) b)[0];
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Gathers how many points every process of the group holds and returns how many of
+ * them the first half of the group keeps, which is where the group's split falls.
+ * A process alone splits its own points in half.
+ */
+long groupSplitTarget(MPI_Comm comm, process *p) {
+    int mine = p->pointsNum;
+    MPI_Allgather(&mine, 1, MPI_INT, p->ws->groupCounts, 1, MPI_INT, comm);
+
+    long target = 0;
+    int displ = 0;
+    for (int i = 0; i < p->comm_size; i++) {
+        p->ws->groupDispls[i] = displ;
+        displ += p->ws->groupCounts[i];
+        if (i < p->comm_size / 2) {
+            target += p->ws->groupCounts[i];
+        }
+    }
+
+    return (p->comm_size == 1) ? p->pointsNum / 2 : target;
+}
+
+
+/**
+ * Finds the exact median of the distances of a group, without gathering them.
+ * Every round each process sends the median and the size of its active range.
+ * The weighted median of those is the pivot. After a three-way partition around it,
+ * the global counts of smaller and equal values tell which part holds the wanted element.
+ * Only O(p) values travel per round and there are O(log N) rounds.
+ */
+float distributedMedian(float *distances, MPI_Comm comm, process *p) {
+    long target = groupSplitTarget(comm, p);
+    // Only a process alone with a single point has nothing to split.
+    if (target == 0) {
+        return distances[0];
+    }
+
+    // Same indices splitValue would look at.
+    long k = target - 1;
+
+    // Work on a copy, the distances have to keep matching the points.
+    float *work = p->ws->work;
+    for (long i = 0; i < p->pointsNum; i++) {
+        work[i] = distances[i];
+    }
+
+    // One (median, active points) pair per process.
+    double mine[2];
+    double *weighted = p->ws->weighted;
+
+    long left = 0, right = p->pointsNum;
+    long lt, gt;
+    long counts[2], globalCounts[2];
+    // The smallest value ever thrown away from the top of the active range.
+    float ceiling = FLT_MAX;
+    float mid1;
+
+    while (true) {
+        long active = right - left;
+        mine[0] = (active) ? kthSmallest(work, left, right - 1, left + (active - 1) / 2) : 0;
+        mine[1] = active;
+        MPI_Allgather(mine, 2, MPI_DOUBLE, weighted, 2, MPI_DOUBLE, comm);
+
+        double totalActive = 0;
+        for (int i = 0; i < p->comm_size; i++) {
+            totalActive += weighted[2 * i + 1];
+        }
+        qsort(weighted, p->comm_size, 2 * sizeof(double), compareWeighted);
+
+        // Weighted median of the local medians.
+        float pivot = 0;
+        double cumulative = 0;
+        for (int i = 0; i < p->comm_size; i++) {
+            cumulative += weighted[2 * i + 1];
+            if (weighted[2 * i + 1] != 0 && 2 * cumulative >= totalActive) {
+                pivot = (float) weighted[2 * i];
+                break;
+            }
+        }
+
+        partition3(work, left, right, pivot, &lt, &gt);
+        counts[0] = lt - left;
+        counts[1] = gt - lt;
+        MPI_Allreduce(counts, globalCounts, 2, MPI_LONG, MPI_SUM, comm);
+
+        if (k < globalCounts[0]) {
+            ceiling = pivot;
+            right = lt;
+        } else if (k < globalCounts[0] + globalCounts[1]) {
+            mid1 = pivot;
+            break;
+        } else {
+            k -= globalCounts[0] + globalCounts[1];
+            left = gt;
+        }
+    }
+
+    // The next element is either another copy of the pivot, the smallest
+    // of the larger values or the smallest value already thrown away.
+    float mid2 = mid1;
+    if (k + 1 >= globalCounts[0] + globalCounts[1]) {
+        float localMin = ceiling;
+        for (long i = gt; i < right; i++) {
+            if (work[i] < localMin) {
+                localMin = work[i];
+            }
+        }
+        MPI_Allreduce(&localMin, &mid2, 1, MPI_FLOAT, MPI_MIN, comm);
+    }
+
+    return (float) ((mid1 + mid2) / 2);
+}
+
+
+static int compareFloats(const void *a, const void *b) {
+    float x = *(const float *) a;
+    float y = *(const float *) b;
+    return (x > y) - (x < y);
+}
+
+
+// The bin of value in a histogram of [lo, hi]. Every process must bin the same way.
+static inline int histogramBin(float value, float lo, float hi) {
+    int bin = (int) ((double) (value - lo) / ((double) hi - lo) * HISTOGRAM_BINS);
+    return (bin < HISTOGRAM_BINS) ? bin : HISTOGRAM_BINS - 1;
+}
+
+
+/**
+ * Finds the same median as distributedMedian with histograms. Every round each process
+ * bins its active distances in [lo, hi], the bins are summed with one MPI_Allreduce and
+ * only the bin that holds the wanted element stays active, its exact bounds becoming
+ * the next [lo, hi]. Once the bin holds few enough candidates, they are gathered and
+ * sorted on every process. Every round moves HISTOGRAM_BINS counts, whatever N is.
+ */
+float histogramMedian(float *distances, MPI_Comm comm, process *p) {
+    long target = groupSplitTarget(comm, p);
+    // Only a process alone with a single point has nothing to split.
+    if (target == 0) {
+        return distances[0];
+    }
+    long k = target - 1;
+    long activeTotal = p->ws->groupDispls[p->comm_size - 1] + p->ws->groupCounts[p->comm_size - 1];
+
+    float *work = p->ws->work;
+    long active = p->pointsNum;
+    memcpy(work, distances, active * sizeof(float));
+
+    // The minimum and the negated maximum, so that a single reduction finds both.
+    float range[2] = {FLT_MAX, FLT_MAX};
+    for (long i = 0; i < active; i++) {
+        range[0] = (work[i] < range[0]) ? work[i] : range[0];
+        range[1] = (-work[i] < range[1]) ? -work[i] : range[1];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, range, 2, MPI_FLOAT, MPI_MIN, comm);
+    float lo = range[0], hi = -range[1];
+
+    // How many values of the group are below lo, and the smallest one ever thrown away above hi.
+    long below = 0;
+    float ceiling = FLT_MAX;
+    long *bins = p->ws->histogram;
+    long *globalBins = &p->ws->histogram[HISTOGRAM_BINS];
+
+    while (lo < hi && activeTotal > HISTOGRAM_CANDIDATES) {
+        memset(bins, 0, HISTOGRAM_BINS * sizeof(long));
+        for (long i = 0; i < active; i++) {
+            bins[histogramBin(work[i], lo, hi)]++;
+        }
+        MPI_Allreduce(bins, globalBins, HISTOGRAM_BINS, MPI_LONG, MPI_SUM, comm);
+
+        int wanted = 0;
+        long cumulative = 0;
+        while (k - below >= cumulative + globalBins[wanted]) {
+            cumulative += globalBins[wanted];
+            wanted++;
+        }
+        below += cumulative;
+        activeTotal = globalBins[wanted];
+
+        // Keep the values of the wanted bin, remember the smallest of the larger ones.
+        long kept = 0;
+        range[0] = FLT_MAX;
+        range[1] = FLT_MAX;
+        for (long i = 0; i < active; i++) {
+            int bin = histogramBin(work[i], lo, hi);
+            if (bin == wanted) {
+                work[kept++] = work[i];
+                range[0] = (work[i] < range[0]) ? work[i] : range[0];
+                range[1] = (-work[i] < range[1]) ? -work[i] : range[1];
+            } else if (bin > wanted && work[i] < ceiling) {
+                ceiling = work[i];
+            }
+        }
+        active = kept;
+        MPI_Allreduce(MPI_IN_PLACE, range, 2, MPI_FLOAT, MPI_MIN, comm);
+        lo = range[0];
+        hi = -range[1];
+    }
+
+    float mid1, mid2;
+    bool nextInside = k + 1 - below < activeTotal;
+    if (lo == hi) {
+        mid1 = lo;
+        mid2 = lo;
+    } else {
+        // Few enough candidates left, every process gathers and sorts them.
+        int mine = active;
+        MPI_Allgather(&mine, 1, MPI_INT, p->ws->groupCounts, 1, MPI_INT, comm);
+        for (int i = 0, displ = 0; i < p->comm_size; i++) {
+            p->ws->groupDispls[i] = displ;
+            displ += p->ws->groupCounts[i];
+        }
+        float *candidates = p->ws->candidates;
+        MPI_Allgatherv(work, mine, MPI_FLOAT, candidates, p->ws->groupCounts, p->ws->groupDispls, MPI_FLOAT, comm);
+        qsort(candidates, activeTotal, sizeof(float), compareFloats);
+
+        mid1 = candidates[k - below];
+        mid2 = (nextInside) ? candidates[k + 1 - below] : 0;
+    }
+
+    // The next element is past the active values, it's the smallest one thrown away.
+    if (!nextInside) {
+        MPI_Allreduce(&ceiling, &mid2, 1, MPI_FLOAT, MPI_MIN, comm);
+    }
+
+    return (float) ((mid1 + mid2) / 2);
+}
+
+
+// Finds the median distance of the group, using the selection the run was configured with.
+// The median splits the points so that the first half of the group can keep exactly
+// as many points as it holds, which is the usual median when every process holds as many.
+// dist_array is only used by the group's master, when gathering.
+float findMedian(float *distances, float *dist_array, MPI_Comm comm, process *p) {
+    float median;
+
+    profile_start(p->prof, PHASE_SELECT);
+    if (p->opt->select == SELECT_DISTRIBUTED) {
+        median = distributedMedian(distances, comm, p);
+    } else if (p->opt->select == SELECT_HISTOGRAM) {
+        median = histogramMedian(distances, comm, p);
+    } else {
+        long target = groupSplitTarget(comm, p);
+        MPI_Gatherv(distances, p->pointsNum, MPI_FLOAT, dist_array, p->ws->groupCounts, p->ws->groupDispls,
+            MPI_FLOAT, 0, comm);
+
+        if (p->comm_rank == 0) {
+            long total = p->ws->groupDispls[p->comm_size - 1] + p->ws->groupCounts[p->comm_size - 1];
+            median = (p->opt->threads > 1)
+                ? parallelSplitValue(dist_array, total, target, p->ws->selectScratch)
+                : splitValue(dist_array, total, target);
+            //printf("\nMedian distance is %f\n\n", median);
+        }
+        // Broadcast median.
+        MPI_Bcast(&median, 1, MPI_FLOAT, 0, comm);
+    }
+    profile_stop(p->prof, PHASE_SELECT);
+
+    return median;
+}
+
+
 // Splits a group of processes to two halves.
 void splitGroup(MPI_Comm *comm, MPI_Comm *new_comm, int *my_new_comm_rank, int *my_new_comm_size,
     int colour, int key, process *p) 
@@ -147,8 +1377,14 @@ void splitGroup(MPI_Comm *comm, MPI_Comm *new_comm, int *my_new_comm_rank, int *
     // Assign the same keys to processes that lie in the same position of each half.
     // key = ((p->comm_rank + 1) * 2 <= p->comm_size) ? p->comm_rank : p->comm_rank - p->comm_size / 2;
     key = p->comm_rank;
+    profile_start(p->prof, PHASE_SPLIT);
     
-    MPI_Comm_split(*comm, colour, key, new_comm);
+    // Only split the first time this level is reached.
+    if (p->ws->comms[p->level] == MPI_COMM_NULL) {
+        MPI_Comm_split(*comm, colour, key, &p->ws->comms[p->level]);
+    }
+    *new_comm = p->ws->comms[p->level];
+    p->level++;
  
     // Get my rank in the new communicator. Update the comm_rank and comm_size placeholders,
     // to be used in the next recursive call of the function.
@@ -156,45 +1392,379 @@ void splitGroup(MPI_Comm *comm, MPI_Comm *new_comm, int *my_new_comm_rank, int *
     MPI_Comm_size(*new_comm, my_new_comm_size);
     p->comm_rank = *my_new_comm_rank;
     p->comm_size = *my_new_comm_size;
+    profile_stop(p->prof, PHASE_SPLIT);
+}
+
+
+/**
+ * Fills unwantedMat with the points every process of the group sends to the other half,
+ * the points equal to the median included. Every process shares how many of its points
+ * are below, equal to and above the median, and the ties are handed out in rank order,
+ * so that the first half ends up with exactly the points it holds now. The ties a process
+ * keeps are moved in front of the rest of its unwanted points, which are the last
+ * unwantedMat[rank] points of the process, and both halves send exactly as many.
+ * @param sorted: what sortByMedian returned.
+ */
+void splitTies(int *sorted, float *points, float *distances, float median, int *unwantedMat,
+    MPI_Comm comm, process *p)
+{
+    // A process alone has nobody to trade with.
+    if (p->comm_size == 1) {
+        unwantedMat[0] = 0;
+        return;
+    }
+
+    int half = p->comm_size / 2;
+    bool left_half = p->comm_rank < half;
+
+    // Below, equal to and above the median, for every process.
+    int wanted = p->pointsNum - sorted[0];
+    int strict = sorted[0] - sorted[1];
+    int mine[3] = {(left_half) ? wanted : strict, sorted[1], (left_half) ? strict : wanted};
+    int *ties = p->ws->tieCounts;
+    profile_start(p->prof, PHASE_WAIT);
+    MPI_Allgather(mine, 3, MPI_INT, ties, 3, MPI_INT, comm);
+    profile_stop(p->prof, PHASE_WAIT);
+
+    // The first half holds target points, of which below are under the median.
+    long target = 0, below = 0;
+    for (int i = 0; i < p->comm_size; i++) {
+        if (i < half) {
+            target += ties[3 * i] + ties[3 * i + 1] + ties[3 * i + 2];
+        }
+        below += ties[3 * i];
+    }
+
+    // The first half's ties stay first, so that as few of them as possible move.
+    long tiesLeft = target - below;
+    int keep = 0;
+    for (int i = 0; i < p->comm_size; i++) {
+        int toLeft = (ties[3 * i + 1] < tiesLeft) ? ties[3 * i + 1] : tiesLeft;
+        tiesLeft -= toLeft;
+        if (i < half) {
+            unwantedMat[i] = ties[3 * i + 2] + ties[3 * i + 1] - toLeft;
+        } else {
+            unwantedMat[i] = ties[3 * i] + toLeft;
+        }
+        if (i == p->comm_rank) {
+            keep = (left_half) ? toLeft : ties[3 * i + 1] - toLeft;
+        }
+    }
+
+    // Move the ties that stay to the front of the unwanted points.
+    long front = p->pointsNum - sorted[0];
+    long back = p->pointsNum - 1;
+    for (long i = front; i < front + keep; i++) {
+        if (distances[i] == median) {
+            continue;
+        }
+        while (distances[back] != median) {
+            back--;
+        }
+        swapFloat(distances, i, back, 1);
+        swapFloat(points, i * p->dims, back * p->dims, p->dims);
+        back--;
+    }
+}
+
+
+/**
+ * Whether traded points carry their distances along. Every level of a single pivot
+ * partitions the same distances, so they only have to be computed once. The tree's
+ * groups pick pivots of their own, and stream records hold their distance anyway.
+ */
+static inline bool shipDistances(process *p) {
+    return p->tree == NULL && p->format->mode != FORMAT_RECORD;
+}
+
+
+/**
+ * A type of count points at block followed by their distances at distBlock, at their
+ * absolute addresses, so that both travel in one message sent from MPI_BOTTOM.
+ * Without distBlock, only the points. The caller frees it.
+ */
+static MPI_Datatype pointsAndDistances(float *block, float *distBlock, long count, process *p) {
+    int lengths[2] = {count, count};
+    MPI_Aint displs[2];
+    MPI_Datatype types[2] = {p->ws->point, MPI_FLOAT};
+    MPI_Get_address(block, &displs[0]);
+    MPI_Get_address(distBlock, &displs[1]);
+
+    MPI_Datatype type;
+    MPI_Type_create_struct((distBlock != NULL) ? 2 : 1, lengths, displs, types, &type);
+    MPI_Type_commit(&type);
+    return type;
 }
 
 
 // Finds the new median after a group of processes has been sorted and split.
-void findNewMedian(float *points, int *unwantedMat, float *distances, float *dist_array, bool *sortedMat,
+// Returns the new median, so the caller can pass it on to the next level.
+float findNewMedian(float *points, int *unwantedMat, float *distances, float *dist_array,
     float median, MPI_Comm new_comm, process *p) 
 {
-    for (int i = 0; i < p->pointsNum; i++) {
-        distances[i] = calculateDistanceArray(points, p->dims * i, p->pivot, p->dims);
+    // The distances came along with the points, unless the group has a new pivot.
+    if (!shipDistances(p)) {
+        pointDistances(points, p->pointsNum, distances, p);
     }
 
-    if (p->comm_rank == 0) {
-        dist_array = (float *) malloc(p->pointsNum * p->comm_size * sizeof(float));
+    median = findMedian(distances, dist_array, new_comm, p);
+
+    // unwantedMat was sized for the largest group, no need to shrink it.
+    int *newSortedByMedian = sortByMedian(distances, points, median, p);
+
+    splitTies(newSortedByMedian, points, distances, median, unwantedMat, new_comm, p);
+
+    return median;
+}
+
+
+/**
+ * Trades count points starting at block with peer, which trades the same amount.
+ * The block is split in chunks. While one chunk is being received in one half of
+ * buffers, the next one is already on its way to the other half. Received chunks are
+ * copied into the block once the matching outgoing chunk has left.
+ * @param distBlock: the distances of the block, traded along with it, or NULL.
+ * @param buffers: 2 * pipelineChunkPoints(p) * (dims + 1) floats, reused for every round.
+ */
+void pipelinedExchange(float *block, float *distBlock, long count, int peer, MPI_Comm comm,
+    float *buffers, process *p)
+{
+    long chunkPoints = pipelineChunkPoints(p);
+    long chunks = (count + chunkPoints - 1) / chunkPoints;
+    long chunkFloats = chunkPoints * (p->dims + 1);
+    MPI_Request recv_req[2], send_req[2];
+
+    for (long c = 0; c < chunks + 1; c++) {
+        // Post the next chunk before waiting for the current one. The types can be freed
+        // right away, MPI keeps them until the requests are done.
+        if (c < chunks) {
+            long len = (c == chunks - 1) ? count - c * chunkPoints : chunkPoints;
+            float *buffer = &buffers[(c % 2) * chunkFloats];
+            MPI_Datatype recvType = pointsAndDistances(buffer,
+                (distBlock != NULL) ? &buffer[len * p->dims] : NULL, len, p);
+            MPI_Datatype sendType = pointsAndDistances(&block[c * chunkPoints * p->dims],
+                (distBlock != NULL) ? &distBlock[c * chunkPoints] : NULL, len, p);
+            MPI_Irecv(MPI_BOTTOM, 1, recvType, peer, 111, comm, &recv_req[c % 2]);
+            MPI_Isend(MPI_BOTTOM, 1, sendType, peer, 111, comm, &send_req[c % 2]);
+            MPI_Type_free(&recvType);
+            MPI_Type_free(&sendType);
+        }
+
+        if (c > 0) {
+            long prev = c - 1;
+            long len = (prev == chunks - 1) ? count - prev * chunkPoints : chunkPoints;
+            float *buffer = &buffers[(prev % 2) * chunkFloats];
+            MPI_Wait(&recv_req[prev % 2], MPI_STATUS_IGNORE);
+            MPI_Wait(&send_req[prev % 2], MPI_STATUS_IGNORE);
+            memcpy(&block[prev * chunkPoints * p->dims], buffer, len * p->dims * sizeof(float));
+            if (distBlock != NULL) {
+                memcpy(&distBlock[prev * chunkPoints], &buffer[len * p->dims], len * sizeof(float));
+            }
+        }
     }
-    MPI_Gather(distances, p->pointsNum, MPI_FLOAT, dist_array, p->pointsNum, MPI_FLOAT, 0, new_comm);
+}
 
-    if (p->comm_rank == 0) {
-        median = quickselect(dist_array, p->pointsNum * p->comm_size - 1);
-        //printf("\nMedian distance is %f\n\n", median);
+
+// Adds the overlap of [start, end) and [peerStart, peerEnd), clipped to limit, as a block of points.
+static void addOverlap(long start, long end, long peerStart, long peerEnd, long limit, long offset,
+    int *lengths, int *displs, int *blocks)
+{
+    long from = (start > peerStart) ? start : peerStart;
+    long to = (end < peerEnd) ? end : peerEnd;
+    to = (to < limit) ? to : limit;
+
+    if (to > from) {
+        lengths[*blocks] = to - from;
+        displs[*blocks] = offset + from - start;
+        (*blocks)++;
+    }
+}
+
+
+/**
+ * Fills groupNodes with the node of every process of the group and nodeOrder with the
+ * ranks of the group, ordered by node and then by rank. Only local calls: the group's
+ * ranks are translated to world ranks, whose nodes are known since the start.
+ */
+void groupTopology(MPI_Comm comm, process *p) {
+    workspace *ws = p->ws;
+    for (int i = 0; i < p->comm_size; i++) {
+        ws->nodeOrder[i] = i;
+        ws->groupNodes[i] = 0;
+    }
+    if (ws->nodeCount == 1) {
+        return;
     }
-    // Broadcast median.
-    MPI_Bcast(&median, 1, MPI_FLOAT, 0, new_comm);
 
-    sortedMat = realloc(sortedMat, p->comm_size * sizeof(bool));
-    unwantedMat = (int *) realloc(unwantedMat ,p->comm_size * sizeof(int));
-    int *newSortedByMedian = sortByMedian(distances, points, median, p);
+    MPI_Group group, world;
+    MPI_Comm_group(comm, &group);
+    MPI_Comm_group(p->world, &world);
+    MPI_Group_translate_ranks(group, p->comm_size, ws->nodeOrder, world, ws->groupNodes);
+    MPI_Group_free(&group);
+    MPI_Group_free(&world);
+    for (int i = 0; i < p->comm_size; i++) {
+        ws->groupNodes[i] = ws->worldNodes[ws->groupNodes[i]];
+    }
+
+    // A stable insertion sort, groups are small.
+    for (int i = 1; i < p->comm_size; i++) {
+        int rank = ws->nodeOrder[i];
+        int j = i - 1;
+        while (j >= 0 && ws->groupNodes[ws->nodeOrder[j]] > ws->groupNodes[rank]) {
+            ws->nodeOrder[j + 1] = ws->nodeOrder[j];
+            j--;
+        }
+        ws->nodeOrder[j + 1] = rank;
+    }
+}
+
+
+// Points the two halves of node n trade within the node, out of the sums of alltoallExchange.
+static inline long tradedWithin(long *sums, int n) {
+    return (sums[2 * n] < sums[2 * n + 1]) ? sums[2 * n] : sums[2 * n + 1];
+}
+
+
+/**
+ * Trades the unwanted points of the whole group at once. The unwanted points of each
+ * half are laid out one after the other, in rank order, and the two layouts are matched
+ * against each other. Every process finds the parts of the matching that concern it
+ * without any further communication. splitTies made both halves send exactly as many
+ * points and both sides of every trade send the same amount, so the points are
+ * exchanged in place, along with their distances.
+ * When pairing by node, each node lays out its own processes the same way and as much
+ * as possible is traded within the node. Only what is left of the two halves of each
+ * node is laid out node after node and matched across nodes.
+ */
+void alltoallExchange(int *unwantedMat, float *points, float *distances, MPI_Comm comm, process *p) {
+    int half = p->comm_size / 2;
+    bool left_half = p->comm_rank < half;
+    int *nodes = p->ws->groupNodes;
+
+    // Start of the unwanted points of every process, in the layout of its half of its node.
+    long *tailStart = p->ws->tailStart;
+    long *sums = p->ws->nodeSums;
+    long *crossStart = &sums[2 * p->ws->nodeCount];
+    for (int n = 0; n < 2 * p->ws->nodeCount; n++) {
+        sums[n] = 0;
+    }
+    for (int i = 0; i < p->comm_size; i++) {
+        tailStart[i] = sums[2 * nodes[i] + (i >= half)];
+        sums[2 * nodes[i] + (i >= half)] += unwantedMat[i];
+    }
 
-    int newUnwantedNum = newSortedByMedian[0];  
+    // Each node trades min(left, right) points within itself, the rest crosses nodes.
+    long crossing[2] = {0, 0};
+    for (int n = 0; n < p->ws->nodeCount; n++) {
+        long within = tradedWithin(sums, n);
+        for (int h = 0; h < 2; h++) {
+            crossStart[2 * n + h] = crossing[h] - within;
+            crossing[h] += sums[2 * n + h] - within;
+        }
+    }
+
+    int me = p->comm_rank;
+
+    // A single block per peer, the overlap of my unwanted points with theirs.
+    int *counts = p->ws->counts;
+    int *zeros = p->ws->zeros;
+    MPI_Datatype *types = p->ws->types;
+    int lengths[1], displs[1];
+    long tradedByMe = 0;
+    bool ship = shipDistances(p);
+    float *block = &(points[p->dims * p->pointsNum - p->dims * unwantedMat[me]]);
+    float *distBlock = &(distances[p->pointsNum - unwantedMat[me]]);
+
+    for (int i = 0; i < p->comm_size; i++) {
+        int blocks = 0;
+        if ((i < half) != left_half && nodes[i] == nodes[me]) {
+            addOverlap(tailStart[me], tailStart[me] + unwantedMat[me], tailStart[i], tailStart[i] + unwantedMat[i],
+                tradedWithin(sums, nodes[me]), 0, lengths, displs, &blocks);
+        } else if ((i < half) != left_half) {
+            // Past the trades within its node, a process's points continue in the layout across nodes.
+            long within = tradedWithin(sums, nodes[me]), peerWithin = tradedWithin(sums, nodes[i]);
+            long from = (tailStart[me] > within) ? tailStart[me] : within;
+            long peerFrom = (tailStart[i] > peerWithin) ? tailStart[i] : peerWithin;
+            long shift = crossStart[2 * nodes[me] + !left_half], peerShift = crossStart[2 * nodes[i] + left_half];
+            addOverlap(shift + from, shift + tailStart[me] + unwantedMat[me],
+                peerShift + peerFrom, peerShift + tailStart[i] + unwantedMat[i],
+                LONG_MAX, from - tailStart[me], lengths, displs, &blocks);
+        }
+
+        if (blocks > 0) {
+            types[i] = pointsAndDistances(&block[displs[0] * p->dims], (ship) ? &distBlock[displs[0]] : NULL,
+                lengths[0], p);
+            counts[i] = 1;
+            tradedByMe += lengths[0];
+        } else {
+            types[i] = MPI_FLOAT;
+            counts[i] = 0;
+        }
+    }
+
+    MPI_Alltoallw(MPI_IN_PLACE, NULL, NULL, NULL, MPI_BOTTOM, counts, zeros, types, comm);
+    profile_exchange(p->prof, p->level, tradedByMe * (p->dims + ship) * sizeof(float), 1);
+
+    unwantedMat[me] -= tradedByMe;
+
+    for (int i = 0; i < p->comm_size; i++) {
+        if (counts[i]) {
+            MPI_Type_free(&types[i]);
+        }
+    }
+}
+
+
+void distributeByMedian(int *unwantedMat, float *points, float *distances, process *p,
+    float median, MPI_Comm comm);
+
+// Splits the group in two halves and calls the recursion on each one.
+void splitAndDistribute(int *unwantedMat, float *points, float *distances, process *p,
+    float median, MPI_Comm comm)
+{
+    // --------------- SPLIT INTO TWO HALVES --------------- //
+
+    MPI_Comm new_comm;
+    int my_new_comm_rank, my_new_comm_size;
+    int colour, key;
+
+    // Every split is a node of the tree. Each half then gets a pivot of its own.
+    if (p->tree != NULL) {
+        vptree_record_level(p->tree, p->pivot, median, p->comm_rank < p->comm_size / 2);
+    }
+
+    splitGroup(&comm, &new_comm, &my_new_comm_rank, &my_new_comm_size, colour, key, p);
+
+    if (p->tree != NULL) {
+        bcast_group_pivot(points, new_comm, p);
+    }
+
+    // --------------- RECALCULATE DISTANCES AND UNWANTED PONTS --------------- //
+
+    median = findNewMedian(points, unwantedMat, distances, p->ws->dist_array, median, new_comm, p);
+
+    // --------------- CALL THE RECURSION --------------- //
 
-    MPI_Allgather(&newUnwantedNum, 1, MPI_INT, unwantedMat, 1, MPI_INT, new_comm);
+    distributeByMedian(unwantedMat, points, distances, p, median, new_comm);
 }
 
 
 void distributeByMedian(int *unwantedMat, float *points, float *distances, process *p,
-    float median, MPI_Comm comm, bool *sortedMat, int pseudo) 
+    float median, MPI_Comm comm) 
 {
     // End of recursion.
     if (p->comm_size == 1) {
-        printf("All points are sorted! \n");
+        return;
+    }
+
+    groupTopology(comm, p);
+
+    // The whole level is done in one exchange, no rounds needed.
+    if (p->opt->exchange == EXCHANGE_ALLTOALL) {
+        profile_start(p->prof, PHASE_EXCHANGE);
+        alltoallExchange(unwantedMat, points, distances, comm, p);
+        profile_stop(p->prof, PHASE_EXCHANGE);
+        splitAndDistribute(unwantedMat, points, distances, p, median, comm);
         return;
     }
 
@@ -202,21 +1772,18 @@ void distributeByMedian(int *unwantedMat, float *points, float *distances, proce
     // contains the larger values.
     bool left_half = p->comm_rank < p->comm_size / 2;
 
-    // The start and end of the indices each process scans for a peer.
-    int peerScanStart = (left_half) ? p->comm_size / 2 : 0; 
-    int peerScanEnd = (left_half) ? p->comm_size : p->comm_size / 2;
-    
-    // The start and end of the indices each process scans for its position
-    // in the side it is on.
-    int posScanStart = (left_half) ? 0 : p->comm_size / 2; 
-    int posScanEnd = p->comm_rank + 1;
+    // Both halves are scanned in this order, the processes of a node one after the other
+    // when pairing by node, so that the k-th processes of the two halves tend to share one.
+    int *order = p->ws->nodeOrder;
 
-    // "Are my points sorted?"
+    // "Are everyone's points sorted?" Both halves send exactly as many points,
+    // so every round someone's unwanted points run out and the rounds always end.
     bool sorted = false;
-    // "Are everyone's points sorted?"
-    bool allsorted = false;
     
-    int round = 0;
+    // Receive buffers of the pipelined exchange, shared by every round.
+    float *buffers = p->ws->buffers;
+    bool ship = shipDistances(p);
+
     while(!sorted) {
         if (unwantedMat[p->comm_rank] != 0) {
             // The process's position in regards to the number of the elements to be sent out.
@@ -229,17 +1796,23 @@ void distributeByMedian(int *unwantedMat, float *points, float *distances, proce
 
             // Find how many procs before me have unwanted elements
             // My_pos > 0
-            for (int i = posScanStart; i < posScanEnd; i++) {
-                if(unwantedMat[i] != 0) {
+            for (int k = 0; k < p->comm_size; k++) {
+                int i = order[k];
+                if ((i < p->comm_size / 2) == left_half && unwantedMat[i] != 0) {
                     my_pos++;
-                } 
+                }
+                if (i == p->comm_rank) {
+                    break;
+                }
             }
 
             // Look at the other side for peer
-            for (int i = peerScanStart; i < peerScanEnd; i++) {
-                if (unwantedMat[i] != 0) {
-                    peer_pos++;
+            for (int k = 0; k < p->comm_size; k++) {
+                int i = order[k];
+                if ((i < p->comm_size / 2) == left_half || unwantedMat[i] == 0) {
+                    continue;
                 }
+                peer_pos++;
                 
                 if (peer_pos == my_pos) {
                     peer = i;
@@ -254,15 +1827,30 @@ void distributeByMedian(int *unwantedMat, float *points, float *distances, proce
             // If peer pos is less than process position then process will not participate in
             // this parallel round
             if (peer_pos == my_pos) {
-                MPI_Sendrecv_replace(&(points[p->dims * p->pointsNum - p->dims * unwantedMat[p->comm_rank]]), p->dims * toTrade, 
-                    MPI_FLOAT, peer, 110, peer, 110, comm, MPI_STATUS_IGNORE);
+                float *block = &(points[p->dims * p->pointsNum - p->dims * unwantedMat[p->comm_rank]]);
+                float *distBlock = (ship) ? &(distances[p->pointsNum - unwantedMat[p->comm_rank]]) : NULL;
+                profile_start(p->prof, PHASE_EXCHANGE);
+                if (p->opt->exchange == EXCHANGE_PIPELINE) {
+                    pipelinedExchange(block, distBlock, toTrade, peer, comm, buffers, p);
+                } else {
+                    // The points and their distances go in a single message.
+                    MPI_Datatype traded = pointsAndDistances(block, distBlock, toTrade, p);
+                    MPI_Sendrecv_replace(MPI_BOTTOM, 1, 
+                        traded, peer, 110, peer, 110, comm, MPI_STATUS_IGNORE);
+                    MPI_Type_free(&traded);
+                }
+                profile_stop(p->prof, PHASE_EXCHANGE);
+                profile_exchange(p->prof, p->level, toTrade * (p->dims + ship) * sizeof(float), 0);
 
                 // Update how many points the process has to get rid of now.
                 unwantedMat[p->comm_rank] -= toTrade;
             }
         }
 
+        profile_start(p->prof, PHASE_WAIT);
         MPI_Allgather(&unwantedMat[p->comm_rank], 1, MPI_INT, unwantedMat, 1, MPI_INT, comm);
+        profile_stop(p->prof, PHASE_WAIT);
+        profile_exchange(p->prof, p->level, 0, 1);
 
         for (int i = 0; i < p->comm_size ; i++) {
             if (unwantedMat[i] != 0) {
@@ -273,76 +1861,33 @@ void distributeByMedian(int *unwantedMat, float *points, float *distances, proce
             }
         }
 
-        // Print the matrix of unwanted points in case a group of processes 
-        // has taken too long to get sorted.
-        if (round > 50 && unwantedMat[p->comm_rank] != 0) {
-            printf("\n\nINFINITE LOOOP\n\n");
-            
-            printf("\nUnwantedMat round %d:\n", round);
-            for (int i = 0; i < p->comm_size; i++) {
-                printf("%d ", unwantedMat[i]);
-            }
-            printf("\n");
-        } 
-
-        // If I am the process that is unsorted, trick the algorithm into
-        // thinking it's done with.
-        if (round > 50) {
-            sorted = true;
-        }
-        round++;
-    }
-
-    // The process that 'lied' turns the sorted value to false again,
-    // in order to broadcast it to the rest of the group.
-    if (round > 50) {
-        sorted = false;
     }
 
-    MPI_Allgather(&sorted, 1, MPI_C_BOOL, sortedMat, 1, MPI_C_BOOL, comm);
-    for (int i = 0; i < p->comm_size; i++) {
-        if (!sortedMat[i]) {
-            allsorted = false;
-            break;
-        } else {
-            allsorted = true;
-        }
-    }
-
-    // See if everyone is sorted. If yes, split into two groups and move on.
-    // Elsewise, sort points again and re-enter distributeByMedian.
-    if (allsorted || pseudo == 1) {
-        // --------------- SPLIT INTO TWO HALVES --------------- //
-
-        MPI_Comm new_comm;
-        int my_new_comm_rank, my_new_comm_size;
-        int colour, key;
-
-        splitGroup(&comm, &new_comm, &my_new_comm_rank, &my_new_comm_size, colour, key, p);
+    // Everyone is sorted, split into two groups and move on.
+    splitAndDistribute(unwantedMat, points, distances, p, median, comm);
+}
 
-        // --------------- RECALCULATE DISTANCES AND UNWANTED PONTS --------------- //
 
-        float *dist_array = NULL;
-        if (p->comm_rank == 0) {
-            dist_array = (float *) malloc(p->pointsNum * p->comm_size * sizeof(float));
-        }
-        findNewMedian(points, unwantedMat, distances, dist_array, sortedMat, median, new_comm, p);
+/**
+ * Partitions the resident points around p->pivot, over the whole world.
+ * Works on whatever layout the previous pivot left behind, and reuses the
+ * communicators the previous pivots split. Returns the first median.
+ */
+float partitionByPivot(float *points, float *distances, process *p) {
+    // Every pivot starts from the whole world again.
+    MPI_Comm_rank(p->world, &p->comm_rank);
+    MPI_Comm_size(p->world, &p->comm_size);
+    p->level = 0;
 
-        // --------------- CALL THE RECURSION --------------- //
+    pointDistances(points, p->pointsNum, distances, p);
+    float median = findMedian(distances, p->ws->dist_array, p->world, p);
 
-        distributeByMedian(unwantedMat, points, distances, p, median, new_comm, sortedMat, 0);
-    } else {
-        float *dist_array = NULL;
-        if (p->comm_rank == 0) {
-            dist_array = (float *) malloc(p->pointsNum * p->comm_size * sizeof(float));
-        }
+    int *sortedByMedian = sortByMedian(distances, points, median, p);
+    splitTies(sortedByMedian, points, distances, median, p->ws->unwantedMat, p->world, p);
 
-        findNewMedian(points, unwantedMat, distances, dist_array, sortedMat, median, comm, p);
+    distributeByMedian(p->ws->unwantedMat, points, distances, p, median, p->world);
 
-        // Distribute by median is called with psuedo = 1 to indicate that this call is not the
-        // This prevents infinite loops where medians are traded
-        distributeByMedian(unwantedMat, points, distances, p, median, comm, sortedMat, 1);
-    }
+    return median;
 }
 
 #endif
\ No newline at end of file
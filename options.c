@@ -0,0 +1,184 @@
+/**
+ * @file: options.c
+ * ********************
+ * @description: Parses the command line arguments of mpi_a.
+ * Usage: mpiexec -np <p> ./mpi_a.o [--select gather|dist|hist] [--partition swap|index]
+ *      [--load master|mpiio|mmap] [--exchange replace|pipeline|alltoall]
+ *      [--queries <file>|-] [--vptree <prefix>] [--k <n>] [--threads <n>]
+ *      [--format float|uint8|fp16] [--profile <file.json|file.csv>]
+ *      [--data <file>] [--seed <n>] [--pivot random|farthest|variance] [--pivot-file <file>]
+ *      [--stream <prefix>] [--pairing rank|node]
+ *      [--hierarchy flat|node] [--verify order|deep] [--layout rows|blocked]
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headers/options.h"
+
+
+// Fills opt with the defaults and overrides them with whatever was given in argv.
+void parse_options(int argc, char **argv, options *opt) {
+    opt->select = SELECT_GATHER;
+    opt->partition = PARTITION_SWAP;
+    opt->load = LOAD_MASTER;
+    opt->exchange = EXCHANGE_REPLACE;
+    opt->queries = NULL;
+    opt->vptree = NULL;
+    opt->k = 10;
+    opt->threads = 0;
+    opt->format = FORMAT_FLOAT;
+    opt->profile = NULL;
+    opt->data = "data/mnist.bin";
+    opt->seed = -1;
+    opt->pivot = PIVOT_RANDOM;
+    opt->pivotFile = NULL;
+    opt->stream = NULL;
+    opt->pairing = PAIRING_RANK;
+    opt->hierarchy = HIERARCHY_FLAT;
+    opt->verify = VERIFY_ORDER;
+    opt->layout = LAYOUT_ROWS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--select") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "gather") == 0) {
+                opt->select = SELECT_GATHER;
+            } else if (strcmp(argv[i], "dist") == 0) {
+                opt->select = SELECT_DISTRIBUTED;
+            } else if (strcmp(argv[i], "hist") == 0) {
+                opt->select = SELECT_HISTOGRAM;
+            } else {
+                printf("Unknown selection mode '%s', using gather.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--partition") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "swap") == 0) {
+                opt->partition = PARTITION_SWAP;
+            } else if (strcmp(argv[i], "index") == 0) {
+                opt->partition = PARTITION_INDEX;
+            } else {
+                printf("Unknown partition mode '%s', using swap.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "master") == 0) {
+                opt->load = LOAD_MASTER;
+            } else if (strcmp(argv[i], "mpiio") == 0) {
+                opt->load = LOAD_MPIIO;
+            } else if (strcmp(argv[i], "mmap") == 0) {
+                opt->load = LOAD_MMAP;
+            } else {
+                printf("Unknown load mode '%s', using master.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--exchange") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "replace") == 0) {
+                opt->exchange = EXCHANGE_REPLACE;
+            } else if (strcmp(argv[i], "pipeline") == 0) {
+                opt->exchange = EXCHANGE_PIPELINE;
+            } else if (strcmp(argv[i], "alltoall") == 0) {
+                opt->exchange = EXCHANGE_ALLTOALL;
+            } else {
+                printf("Unknown exchange mode '%s', using replace.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc) {
+            i++;
+            opt->queries = argv[i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            i++;
+            opt->profile = argv[i];
+        } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+            i++;
+            opt->data = argv[i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            i++;
+            opt->seed = atol(argv[i]);
+        } else if (strcmp(argv[i], "--pivot") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "random") == 0) {
+                opt->pivot = PIVOT_RANDOM;
+            } else if (strcmp(argv[i], "farthest") == 0) {
+                opt->pivot = PIVOT_FARTHEST;
+            } else if (strcmp(argv[i], "variance") == 0) {
+                opt->pivot = PIVOT_VARIANCE;
+            } else {
+                printf("Unknown pivot policy '%s', using random.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--pivot-file") == 0 && i + 1 < argc) {
+            i++;
+            opt->pivot = PIVOT_USER;
+            opt->pivotFile = argv[i];
+        } else if (strcmp(argv[i], "--pairing") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "rank") == 0) {
+                opt->pairing = PAIRING_RANK;
+            } else if (strcmp(argv[i], "node") == 0) {
+                opt->pairing = PAIRING_NODE;
+            } else {
+                printf("Unknown pairing '%s', using rank.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--hierarchy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "flat") == 0) {
+                opt->hierarchy = HIERARCHY_FLAT;
+            } else if (strcmp(argv[i], "node") == 0) {
+                opt->hierarchy = HIERARCHY_NODE;
+            } else {
+                printf("Unknown hierarchy '%s', using flat.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "order") == 0) {
+                opt->verify = VERIFY_ORDER;
+            } else if (strcmp(argv[i], "deep") == 0) {
+                opt->verify = VERIFY_DEEP;
+            } else {
+                printf("Unknown check '%s', using order.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "rows") == 0) {
+                opt->layout = LAYOUT_ROWS;
+            } else if (strcmp(argv[i], "blocked") == 0) {
+                opt->layout = LAYOUT_BLOCKED;
+            } else {
+                printf("Unknown layout '%s', using rows.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            i++;
+            opt->stream = argv[i];
+        } else if (strcmp(argv[i], "--vptree") == 0 && i + 1 < argc) {
+            i++;
+            opt->vptree = argv[i];
+        } else if (strcmp(argv[i], "--k") == 0 && i + 1 < argc) {
+            i++;
+            opt->k = atoi(argv[i]);
+            if (opt->k < 1) {
+                printf("Invalid k '%s', using 10.\n", argv[i]);
+                opt->k = 10;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            i++;
+            opt->threads = atoi(argv[i]);
+            if (opt->threads < 0) {
+                printf("Invalid thread count '%s', using the OpenMP default.\n", argv[i]);
+                opt->threads = 0;
+            }
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "float") == 0) {
+                opt->format = FORMAT_FLOAT;
+            } else if (strcmp(argv[i], "uint8") == 0) {
+                opt->format = FORMAT_UINT8;
+            } else if (strcmp(argv[i], "fp16") == 0) {
+                opt->format = FORMAT_FP16;
+            } else {
+                printf("Unknown point format '%s', using float.\n", argv[i]);
+            }
+        } else {
+            printf("Ignoring unknown argument '%s'.\n", argv[i]);
+        }
+    }
+}
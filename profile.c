@@ -0,0 +1,146 @@
+/**
+ * @file: profile.c
+ * ********************
+ * @description: Per-phase timers and traffic of a run. The timers are plain
+ * MPI_Wtime pairs, so they cost nothing worth mentioning and are always on.
+ * The report is written as CSV if the file ends in ".csv" and as JSON otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <mpi.h>
+
+#include "headers/profile.h"
+
+static const char *phaseNames[PHASE_COUNT] = {
+    "io", "distance", "select", "partition", "exchange", "split", "wait"
+};
+
+
+void profile_init(profile *prof) {
+    memset(prof, 0, sizeof(profile));
+}
+
+
+void profile_start(profile *prof, profile_phase phase) {
+    prof->started[phase] = MPI_Wtime();
+}
+
+
+void profile_stop(profile *prof, profile_phase phase) {
+    prof->seconds[phase] += MPI_Wtime() - prof->started[phase];
+}
+
+
+// Adds the bytes and the rounds of an exchange of the given level.
+void profile_exchange(profile *prof, int level, long bytes, long rounds) {
+    if (level >= PROFILE_MAX_LEVELS) {
+        return;
+    }
+    prof->bytes[level] += bytes;
+    prof->rounds[level] += rounds;
+    if (level + 1 > prof->levels) {
+        prof->levels = level + 1;
+    }
+}
+
+
+static void writeStat(FILE *fp, bool csv, const char *name, int level, double min, double mean, double max) {
+    if (csv) {
+        if (level < 0) {
+            fprintf(fp, "%s,,%.9g,%.9g,%.9g\n", name, min, mean, max);
+        } else {
+            fprintf(fp, "%s,%d,%.9g,%.9g,%.9g\n", name, level, min, mean, max);
+        }
+    } else {
+        fprintf(fp, "\"%s\": {\"min\": %.9g, \"mean\": %.9g, \"max\": %.9g}", name, min, mean, max);
+    }
+}
+
+
+/**
+ * Combines the profiles of every process of comm on its first process, which writes
+ * them to filename. Times are averaged over every process, the traffic of a level
+ * only over the processes that went through it.
+ */
+void profile_report(profile *prof, char *filename, MPI_Comm comm) {
+    int size, rank;
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+
+    // The phases, then the total.
+    double times[PHASE_COUNT + 1];
+    double timesMin[PHASE_COUNT + 1], timesMax[PHASE_COUNT + 1], timesSum[PHASE_COUNT + 1];
+    memcpy(times, prof->seconds, PHASE_COUNT * sizeof(double));
+    times[PHASE_COUNT] = prof->total;
+    MPI_Reduce(times, timesMin, PHASE_COUNT + 1, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(times, timesMax, PHASE_COUNT + 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(times, timesSum, PHASE_COUNT + 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+
+    int levels;
+    MPI_Allreduce(&prof->levels, &levels, 1, MPI_INT, MPI_MAX, comm);
+
+    // Bytes, rounds and whether the level was reached. The levels that weren't are left out of the minimum.
+    long traffic[3 * PROFILE_MAX_LEVELS], reachedOnly[3 * PROFILE_MAX_LEVELS];
+    long lows[3 * PROFILE_MAX_LEVELS], highs[3 * PROFILE_MAX_LEVELS], sums[3 * PROFILE_MAX_LEVELS];
+    for (int l = 0; l < levels; l++) {
+        bool reached = l < prof->levels;
+        traffic[3 * l] = prof->bytes[l];
+        traffic[3 * l + 1] = prof->rounds[l];
+        traffic[3 * l + 2] = reached;
+        reachedOnly[3 * l] = (reached) ? prof->bytes[l] : LONG_MAX;
+        reachedOnly[3 * l + 1] = (reached) ? prof->rounds[l] : LONG_MAX;
+        reachedOnly[3 * l + 2] = reached;
+    }
+    MPI_Reduce(reachedOnly, lows, 3 * levels, MPI_LONG, MPI_MIN, 0, comm);
+    MPI_Reduce(traffic, highs, 3 * levels, MPI_LONG, MPI_MAX, 0, comm);
+    MPI_Reduce(traffic, sums, 3 * levels, MPI_LONG, MPI_SUM, 0, comm);
+
+    if (rank == 0) {
+        FILE *fp = fopen(filename, "w");
+        if (fp == NULL) {
+            printf("Could not open %s.\n", filename);
+            return;
+        }
+
+        size_t length = strlen(filename);
+        bool csv = length >= 4 && strcmp(&filename[length - 4], ".csv") == 0;
+
+        if (csv) {
+            fprintf(fp, "metric,level,min,mean,max\n");
+        } else {
+            fprintf(fp, "{\n  \"processes\": %d,\n  \"seconds\": {\n    ", size);
+        }
+        for (int i = 0; i <= PHASE_COUNT; i++) {
+            const char *name = (i < PHASE_COUNT) ? phaseNames[i] : "total";
+            writeStat(fp, csv, name, -1, timesMin[i], timesSum[i] / size, timesMax[i]);
+            if (!csv) {
+                fprintf(fp, (i < PHASE_COUNT) ? ",\n    " : "\n  },\n  \"levels\": [");
+            }
+        }
+
+        for (int l = 0; l < levels; l++) {
+            long reached = sums[3 * l + 2];
+            if (!csv) {
+                fprintf(fp, (l == 0) ? "\n    {\"level\": %d, " : ",\n    {\"level\": %d, ", l);
+                fprintf(fp, "\"processes\": %ld, ", reached);
+            }
+            writeStat(fp, csv, "bytes", l, lows[3 * l], (double) sums[3 * l] / reached, highs[3 * l]);
+            if (!csv) {
+                fprintf(fp, ", ");
+            }
+            writeStat(fp, csv, "rounds", l, lows[3 * l + 1], (double) sums[3 * l + 1] / reached, highs[3 * l + 1]);
+            if (!csv) {
+                fprintf(fp, "}");
+            }
+        }
+        if (!csv) {
+            fprintf(fp, (levels > 0) ? "\n  ]\n}\n" : "]\n}\n");
+        }
+
+        fclose(fp);
+    }
+}
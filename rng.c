@@ -0,0 +1,53 @@
+/**
+ * @file: rng.c
+ * ********************
+ * @description: splitmix64, along with uniform, normal and bounded integer draws.
+ */ 
+
+#include <stdint.h>
+#include <math.h>
+
+#include "headers/rng.h"
+
+
+void rng_seed(rng *r, uint64_t seed) {
+    r->state = seed;
+}
+
+
+uint64_t rng_next(rng *r) {
+    uint64_t z = (r->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+// The seed of one of the streams of seed, e.g. of a process or a thread,
+// unrelated to the seeds of the other streams and of nearby seeds.
+uint64_t rng_stream(uint64_t seed, uint64_t stream) {
+    rng r;
+    rng_seed(&r, stream);
+    rng_seed(&r, seed ^ rng_next(&r));
+    return rng_next(&r);
+}
+
+
+// Uniform in [0, 1), from the top 53 bits.
+double rng_uniform(rng *r) {
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// Standard normal, with the Box-Muller transform.
+double rng_normal(rng *r) {
+    double u = 1.0 - rng_uniform(r);
+    double v = rng_uniform(r);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+
+// Uniform in [0, n). The modulo bias is negligible for any n the points come in.
+long rng_below(rng *r, long n) {
+    return (long) (rng_next(r) % (uint64_t) n);
+}
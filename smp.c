@@ -0,0 +1,267 @@
+/**
+ * @file: smp.c
+ * ********************
+ * @description: Shared-memory engine. The recursion of distributeByMedian runs
+ * as OpenMP tasks: the two halves of a range are independent, so whichever
+ * thread is idle picks up the next one. Every range is split in place by a
+ * parallel nth_element, whose loops are taskloops, so a large range near the
+ * top is still split between all the threads while the small ones further
+ * down run one per thread. Nothing is sent anywhere, points are only swapped.
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <float.h>
+#include <omp.h>
+
+#include "headers/smp.h"
+#include "headers/helpers.h"
+
+// Points per task of a taskloop.
+#define SMP_BLOCK (1 << 14)
+// Ranges smaller than this are selected serially.
+#define SMP_SERIAL (1 << 15)
+
+#define SWAP(x, y) { float temp = x; x = y; y = temp; }
+
+
+void smp_init(smp_engine *e, float *points, float *distances, long dims, long pointsTotal, int parts) {
+    e->points = points;
+    e->distances = distances;
+    e->dims = dims;
+    e->pointsTotal = pointsTotal;
+    e->parts = parts;
+
+    e->selectA = (float *) malloc(pointsTotal * sizeof(float));
+    e->selectB = (float *) malloc(pointsTotal * sizeof(float));
+    e->lists = (long *) malloc(pointsTotal * sizeof(long));
+}
+
+
+void smp_free(smp_engine *e) {
+    free(e->selectA);
+    free(e->selectB);
+    free(e->lists);
+}
+
+
+// Where the points of part i start, the same split mpi_a.c uses between processes.
+static long partStart(smp_engine *e, int i) {
+    if (i == e->parts) {
+        return e->pointsTotal;
+    }
+
+    long count, offset;
+    rankChunk(e->pointsTotal, e->parts, i, &count, &offset);
+    return offset;
+}
+
+
+static long blocksOf(long n) {
+    return (n + SMP_BLOCK - 1) / SMP_BLOCK;
+}
+
+
+// Whether d belongs to the kind of values a pass is after: below, equal to or above value.
+static inline bool matches(float d, float value, int kind) {
+    return (kind < 0) ? d < value : (kind > 0) ? d > value : d == value;
+}
+
+
+// Same as compactValues, but writes the indices (from + i) of the values instead.
+static long collectIndices(const float *dist, long from, long to, float value, int kind, long *out) {
+    long n = to - from;
+    long blocks = blocksOf(n);
+    long *offsets = (long *) calloc(blocks + 1, sizeof(long));
+
+    #pragma omp taskloop grainsize(1)
+    for (long b = 0; b < blocks; b++) {
+        long end = (b + 1) * SMP_BLOCK < n ? (b + 1) * SMP_BLOCK : n;
+        long count = 0;
+        for (long i = b * SMP_BLOCK; i < end; i++) {
+            count += matches(dist[from + i], value, kind);
+        }
+        offsets[b + 1] = count;
+    }
+
+    for (long b = 0; b < blocks; b++) {
+        offsets[b + 1] += offsets[b];
+    }
+
+    #pragma omp taskloop grainsize(1)
+    for (long b = 0; b < blocks; b++) {
+        long end = (b + 1) * SMP_BLOCK < n ? (b + 1) * SMP_BLOCK : n;
+        long pos = offsets[b];
+        for (long i = b * SMP_BLOCK; i < end; i++) {
+            if (matches(dist[from + i], value, kind)) {
+                out[pos++] = from + i;
+            }
+        }
+    }
+
+    long total = offsets[blocks];
+    free(offsets);
+    return total;
+}
+
+
+/**
+ * The k-th smallest of the n values of a. Every round each block counts its values
+ * below and equal to a random pivot. Only the side that holds the k-th one is kept,
+ * and the counts tell every block where to copy its part of it in the other buffer.
+ * Both a and scratch are overwritten.
+ */
+static float selectValue(float *a, long n, long k, float *scratch) {
+    float *src = a, *dst = scratch;
+
+    while (n >= SMP_SERIAL) {
+        float pivot = src[selectionRandom(n)];
+
+        long blocks = blocksOf(n);
+        long *counts = (long *) calloc(2 * blocks, sizeof(long));
+        #pragma omp taskloop grainsize(1)
+        for (long b = 0; b < blocks; b++) {
+            long end = (b + 1) * SMP_BLOCK < n ? (b + 1) * SMP_BLOCK : n;
+            long lt = 0, eq = 0;
+            for (long i = b * SMP_BLOCK; i < end; i++) {
+                lt += src[i] < pivot;
+                eq += src[i] == pivot;
+            }
+            counts[2 * b] = lt;
+            counts[2 * b + 1] = end - b * SMP_BLOCK - lt - eq;
+        }
+
+        long lt = 0, gt = 0;
+        for (long b = 0; b < blocks; b++) {
+            lt += counts[2 * b];
+            gt += counts[2 * b + 1];
+        }
+
+        int kind;
+        if (k < lt) {
+            kind = -1;
+        } else if (k < n - gt) {
+            free(counts);
+            return pivot;
+        } else {
+            kind = 1;
+            k -= n - gt;
+        }
+
+        // Turn the counts of the kept side into where each block starts writing.
+        long pos = 0;
+        for (long b = 0; b < blocks; b++) {
+            long count = counts[2 * b + (kind > 0)];
+            counts[2 * b] = pos;
+            pos += count;
+        }
+
+        #pragma omp taskloop grainsize(1)
+        for (long b = 0; b < blocks; b++) {
+            long end = (b + 1) * SMP_BLOCK < n ? (b + 1) * SMP_BLOCK : n;
+            long at = counts[2 * b];
+            for (long i = b * SMP_BLOCK; i < end; i++) {
+                if (matches(src[i], pivot, kind)) {
+                    dst[at++] = src[i];
+                }
+            }
+        }
+        free(counts);
+
+        n = pos;
+        float *temp = src; src = dst; dst = temp;
+    }
+
+    return kthSmallest(src, 0, n - 1, k);
+}
+
+
+/**
+ * Parallel nth_element of the points [lo, hi): the k points with the smallest
+ * distances end up first. The k-th smallest distance is selected on a copy, then
+ * the points on the wrong side of it are listed and swapped pairwise, in place.
+ * Ties fill whatever room is left on either side.
+ */
+static void nthElement(smp_engine *e, long lo, long hi, long k) {
+    long n = hi - lo;
+    float *dist = e->distances;
+    long dims = e->dims;
+
+    memcpy(&e->selectA[lo], &dist[lo], n * sizeof(float));
+    float value = selectValue(&e->selectA[lo], n, k - 1, &e->selectB[lo]);
+
+    // Misplaced points of the left side are listed from lo, the ones of the right side from mid.
+    long mid = lo + k;
+    long *left = &e->lists[lo];
+    long *right = &e->lists[mid];
+    long larger = collectIndices(dist, lo, mid, value, 1, left);
+    long smaller = collectIndices(dist, mid, hi, value, -1, right);
+
+    // Whichever side has fewer misplaced points gives away some of its ties instead.
+    long pairs = (larger > smaller) ? larger : smaller;
+    if (smaller > larger) {
+        collectIndices(dist, lo, mid, value, 0, &left[larger]);
+    } else if (larger > smaller) {
+        collectIndices(dist, mid, hi, value, 0, &right[smaller]);
+    }
+
+    #pragma omp taskloop grainsize(SMP_BLOCK / 16)
+    for (long j = 0; j < pairs; j++) {
+        long x = left[j], y = right[j];
+        SWAP(dist[x], dist[y]);
+        for (long d = 0; d < dims; d++) {
+            SWAP(e->points[x * dims + d], e->points[y * dims + d]);
+        }
+    }
+}
+
+
+// Splits the parts [pa, pb) in two halves, then each half on its own task.
+static void partitionParts(smp_engine *e, int pa, int pb) {
+    if (pb - pa < 2) {
+        return;
+    }
+
+    int pm = pa + (pb - pa) / 2;
+    long lo = partStart(e, pa), mid = partStart(e, pm), hi = partStart(e, pb);
+    nthElement(e, lo, hi, mid - lo);
+
+    #pragma omp task
+    partitionParts(e, pa, pm);
+    #pragma omp task
+    partitionParts(e, pm, pb);
+}
+
+
+// Sorts the points by their distance, up to the parts. Uses the threads OpenMP is set up with.
+void smp_distribute(smp_engine *e) {
+    #pragma omp parallel
+    #pragma omp single
+    partitionParts(e, 0, e->parts);
+}
+
+
+// Same as the self check of mpi_a.c: no part may hold a distance larger than the next one's minimum.
+bool smp_check(smp_engine *e) {
+    bool inOrder = true;
+
+    #pragma omp parallel for reduction(&&:inOrder) schedule(dynamic)
+    for (int i = 0; i < e->parts - 1; i++) {
+        float max = -FLT_MAX, nextMin = FLT_MAX;
+        for (long j = partStart(e, i); j < partStart(e, i + 1); j++) {
+            if (e->distances[j] > max) {
+                max = e->distances[j];
+            }
+        }
+        for (long j = partStart(e, i + 1); j < partStart(e, i + 2); j++) {
+            if (e->distances[j] < nextMin) {
+                nextMin = e->distances[j];
+            }
+        }
+        inOrder = inOrder && max <= nextMin;
+    }
+
+    return inOrder;
+}
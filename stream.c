@@ -0,0 +1,268 @@
+/**
+ * @file: stream.c
+ * ********************
+ * @description: Out-of-core mode. Every process reads its own chunk of the file with
+ * MPI-IO, a block at a time, and only keeps a stream_record of every point. The records
+ * go through the usual recursion as points of STREAM_RECORD_FLOATS floats, and the
+ * points themselves are only read again once every process knows which ones it owns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <mpi.h>
+
+#include "headers/options.h"
+#include "headers/process.h"
+#include "headers/shared.h"
+#include "headers/workspace.h"
+#include "headers/mpihelp.h"
+#include "headers/distance.h"
+#include "headers/profile.h"
+#include "headers/rng.h"
+#include "headers/stream.h"
+
+
+// Points in a block of the file.
+static long blockPoints(long dims) {
+    long points = STREAM_BLOCK_BYTES / (dims * sizeof(float));
+    return (points > 0) ? points : 1;
+}
+
+
+// Reads count points of the chunk of origin, starting at its point first.
+static void readPoints(MPI_File fh, int origin, long first, long count, float *out, MPI_Datatype point, process *p) {
+    long dims = p->format->features;
+    MPI_Offset offset = 2 * sizeof(long)
+        + (MPI_Offset) (p->ws->worldOffsets[origin] + first) * dims * sizeof(float);
+    MPI_File_read_at(fh, offset, out, count, point, MPI_STATUS_IGNORE);
+}
+
+
+/**
+ * Picks the first pivot while the points are still on disk. It is drawn out of every
+ * point, like PIVOT_RANDOM, and only its owner reads it. Pivots from a file are read
+ * as usual. The other policies need every point in memory and fall back to a random one.
+ */
+void stream_pivot(MPI_File fh, process *p) {
+    long dims = p->format->features;
+
+    // read_query_pivot expects float points.
+    if (p->opt->pivot == PIVOT_USER) {
+        long stored = p->dims;
+        p->dims = dims;
+        p->format->mode = FORMAT_FLOAT;
+        bcast_pivot(p, p->pivot, NULL);
+        p->dims = stored;
+        p->format->mode = FORMAT_RECORD;
+        return;
+    }
+    if (p->opt->pivot != PIVOT_RANDOM && p->comm_rank == 0) {
+        printf("The points are on disk, picking a random pivot instead.\n");
+    }
+
+    long global = rng_below(&p->ws->pivots,
+        p->ws->worldOffsets[p->comm_size - 1] + p->ws->worldCounts[p->comm_size - 1]);
+    int owner = 0;
+    while (global >= p->ws->worldOffsets[owner] + p->ws->worldCounts[owner]) {
+        owner++;
+    }
+
+    if (p->comm_rank == owner) {
+        long index = global - p->ws->worldOffsets[owner];
+        readPoints(fh, owner, index, dims, p->pivot, MPI_FLOAT, p);
+        printf("Pivot index is %ld of process %d\n", index, owner);
+    }
+    MPI_Bcast(p->pivot, dims, MPI_FLOAT, owner, MPI_COMM_WORLD);
+}
+
+
+/**
+ * Reads the chunk of the process block by block and returns a record of every point,
+ * with its distance from p->pivot. Only a block of points is in memory at a time.
+ */
+float *stream_records(MPI_File fh, process *p) {
+    long dims = p->format->features;
+    long block = blockPoints(dims);
+    float *points = (float *) malloc(block * dims * sizeof(float));
+    float *distances = (float *) malloc(block * sizeof(float));
+    stream_record *records = (stream_record *) malloc(p->pointsNum * sizeof(stream_record));
+
+    MPI_Datatype point;
+    MPI_Type_contiguous(dims, MPI_FLOAT, &point);
+    MPI_Type_commit(&point);
+
+    for (long first = 0; first < p->pointsNum; first += block) {
+        long count = (p->pointsNum - first < block) ? p->pointsNum - first : block;
+
+        profile_start(p->prof, PHASE_IO);
+        readPoints(fh, p->comm_rank, first, count, points, point, p);
+        profile_stop(p->prof, PHASE_IO);
+
+        profile_start(p->prof, PHASE_DISTANCE);
+        distancesBatch(points, count, dims, p->pivot, distances);
+        profile_stop(p->prof, PHASE_DISTANCE);
+
+        for (long i = 0; i < count; i++) {
+            records[first + i].dist = distances[i];
+            records[first + i].origin = p->comm_rank;
+            records[first + i].offset = first + i;
+        }
+    }
+
+    MPI_Type_free(&point);
+    free(points);
+    free(distances);
+
+    return (float *) records;
+}
+
+
+// Orders records by where their points are on disk.
+static int compareRecords(const void *a, const void *b) {
+    const stream_record *x = (const stream_record *) a;
+    const stream_record *y = (const stream_record *) b;
+    if (x->origin != y->origin) {
+        return (x->origin > y->origin) - (x->origin < y->origin);
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+
+/**
+ * Hands every point to the process that owns its record and writes them to
+ * <prefix><rank>.bin, in the format of data/binmake.jl. Every process first tells the
+ * owners of the chunks which of their points it wants. Then, one block at a time, every
+ * process reads its chunk and a single MPI_Alltoallv hands the wanted points of the block
+ * to the processes that asked for them, which append them to their file. The records are
+ * sorted by where their points are on disk, so both sides know the counts of every round
+ * without asking. Only a block, the points sent or received in a round and the lists of
+ * offsets are ever in memory.
+ */
+void stream_write(MPI_File fh, float *recordFloats, char *prefix, process *p) {
+    // The recursion left p->comm_rank and p->comm_size at those of the last group.
+    int size, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    long dims = p->format->features;
+    long n = p->pointsNum;
+    stream_record *records = (stream_record *) recordFloats;
+    qsort(records, n, sizeof(stream_record), compareRecords);
+
+    // How many points this process wants from every process and every process from this one.
+    int *wanted = (int *) calloc(4 * size, sizeof(int));
+    int *wantedDispls = &wanted[size];
+    int *asked = &wanted[2 * size];
+    int *askedDispls = &wanted[3 * size];
+    for (long i = 0; i < n; i++) {
+        wanted[records[i].origin]++;
+    }
+    MPI_Alltoall(wanted, 1, MPI_INT, asked, 1, MPI_INT, MPI_COMM_WORLD);
+
+    long totalAsked = 0;
+    for (int i = 0, displ = 0; i < size; i++) {
+        wantedDispls[i] = displ;
+        displ += wanted[i];
+        askedDispls[i] = totalAsked;
+        totalAsked += asked[i];
+    }
+
+    long *offsets = (long *) malloc(n * sizeof(long));
+    long *requests = (long *) malloc(totalAsked * sizeof(long));
+    for (long i = 0; i < n; i++) {
+        offsets[i] = records[i].offset;
+    }
+    MPI_Alltoallv(offsets, wanted, wantedDispls, MPI_LONG, requests, asked, askedDispls, MPI_LONG, MPI_COMM_WORLD);
+
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s%d.bin", prefix, rank);
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        printf("Could not open %s.\n", filename);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    fwrite(&dims, sizeof(long), 1, out);
+    fwrite(&n, sizeof(long), 1, out);
+
+    MPI_Datatype point;
+    MPI_Type_contiguous(dims, MPI_FLOAT, &point);
+    MPI_Type_commit(&point);
+
+    long chunk = p->ws->worldCounts[rank];
+    long block = blockPoints(dims);
+    long rounds = (chunk + block - 1) / block;
+    MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+
+    // Where every list is up to, on both sides.
+    long *askedNext = (long *) malloc(2 * size * sizeof(long));
+    long *wantedNext = &askedNext[size];
+    int *counts = (int *) malloc(4 * size * sizeof(int));
+    int *sendCounts = counts, *sendDispls = &counts[size];
+    int *recvCounts = &counts[2 * size], *recvDispls = &counts[3 * size];
+    for (int i = 0; i < size; i++) {
+        askedNext[i] = askedDispls[i];
+        wantedNext[i] = wantedDispls[i];
+    }
+
+    // Every point of a block goes to a single process, the received ones may come from all.
+    float *points = (float *) malloc(block * dims * sizeof(float));
+    float *send = (float *) malloc(block * dims * sizeof(float));
+    float *recv = NULL;
+    long recvCap = 0;
+
+    for (long r = 0; r < rounds; r++) {
+        long first = r * block;
+        long count = (first >= chunk) ? 0 : (chunk - first < block) ? chunk - first : block;
+        profile_start(p->prof, PHASE_IO);
+        if (count > 0) {
+            readPoints(fh, rank, first, count, points, point, p);
+        }
+        profile_stop(p->prof, PHASE_IO);
+
+        int packed = 0;
+        for (int i = 0; i < size; i++) {
+            sendDispls[i] = packed;
+            while (askedNext[i] < askedDispls[i] + asked[i] && requests[askedNext[i]] < first + count) {
+                memcpy(&send[packed * dims], &points[(requests[askedNext[i]] - first) * dims], dims * sizeof(float));
+                packed++;
+                askedNext[i]++;
+            }
+            sendCounts[i] = packed - sendDispls[i];
+        }
+
+        int received = 0;
+        for (int i = 0; i < size; i++) {
+            recvDispls[i] = received;
+            while (wantedNext[i] < wantedDispls[i] + wanted[i] && offsets[wantedNext[i]] < first + block) {
+                received++;
+                wantedNext[i]++;
+            }
+            recvCounts[i] = received - recvDispls[i];
+        }
+        if (received > recvCap) {
+            recvCap = received;
+            recv = (float *) realloc(recv, recvCap * dims * sizeof(float));
+        }
+
+        profile_start(p->prof, PHASE_EXCHANGE);
+        MPI_Alltoallv(send, sendCounts, sendDispls, point, recv, recvCounts, recvDispls, point, MPI_COMM_WORLD);
+        profile_stop(p->prof, PHASE_EXCHANGE);
+
+        profile_start(p->prof, PHASE_IO);
+        fwrite(recv, sizeof(float), received * dims, out);
+        profile_stop(p->prof, PHASE_IO);
+    }
+
+    fclose(out);
+    MPI_Type_free(&point);
+    free(wanted);
+    free(offsets);
+    free(requests);
+    free(askedNext);
+    free(counts);
+    free(points);
+    free(send);
+    free(recv);
+}
@@ -1,107 +1,138 @@
+/**
+ * @file: test.c
+ * ********************
+ * @description: Checks of the building blocks of mpi_a.c against plain references.
+ * Run by make test, on a few processes: every check runs on all of them and
+ * passes only if it passes on every one.
+ */ 
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <math.h>
- 
-#define SWAP(x, y) { float temp = x; x = y; y = temp; }
-
-int maxPower(int num, int base, int rep) {
-	if (pow(base, rep) > num) {
-		return -1;
-	} 
-	else if (pow(base, rep) == num) {
-		return 0;
-	} else {
-		return 1 + maxPower(num, base, rep+1);
-	}
-}
-
- 
-// Partition using Lomuto partition scheme
-int partition(float* a, int left, int right, int pIndex)
-{
-    // pick `pIndex` as a pivot from the array
-    float pivot = a[pIndex];
- 
-    // Move pivot to end
-    SWAP(a[pIndex], a[right]);
- 
-    // elements less than the pivot will be pushed to the left of `pIndex`;
-    // elements more than the pivot will be pushed to the right of `pIndex`;
-    // equal elements can go either way
-    pIndex = left;
- 
-    // each time we find an element less than or equal to the pivot, `pIndex`
-    // is incremented, and that element would be placed before the pivot.
-    for (int i = left; i < right; i++)
-    {
-        if (a[i] <= pivot)
-        {
-            SWAP(a[i], a[pIndex]);
-            pIndex++;
-        }
-    }
- 
-    // move pivot to its final place
-    SWAP(a[pIndex], a[right]);
- 
-    // return `pIndex` (index of the pivot element)
-    return pIndex;
-}
- 
-// Returns the k'th smallest element in the list within `left…right`
-// (i.e., left <= k <= right). The search space within the array is
-// changing for each round – but the list is still the same size.
-// Thus, `k` does not need to be updated with each round.
-float kthSmallest(float* nums, int left, int right, int k)
-{
-    // If the array contains only one element, return that element
-    if (left == right) {
-        return nums[left];
-    }
- 
-    // select `pIndex` between left and right
-    int pIndex = left + rand() % (right - left + 1);
- 
-    pIndex = partition(nums, left, right, pIndex);
- 
-    // The pivot is in its final sorted position
-    if (k == pIndex) {
-        return nums[k];
-    }
- 
-    // if `k` is less than the pivot index
-    else if (k < pIndex) {
-        return kthSmallest(nums, left, pIndex - 1, k);
-    }
- 
-    // if `k` is more than the pivot index
-    else {
-        return kthSmallest(nums, pIndex + 1, right, k);
-    }
-}
-
-float quickselect(float *distances, uint end) {
-	// The index where the median is supposed to be.
-	uint mid_index = (end+1) / 2;
-
-	// The median is calculated depending on whether the population is even or odd.
-	if ((end+1) % 2 == 0) {
-	
-		float mid1 = kthSmallest(distances, 0, end, mid_index - 1);
-		float mid2 = kthSmallest(distances, 0, end, mid_index);
-		
-		printf("mid1 = %f, mid2 = %f\n", mid1, mid2);
-
-	
-		return (float) ((mid1 + mid2) / 2);
-	} else {
-        printf("GAMIESAI");
-		return kthSmallest(distances, 0, end, mid_index);
-	}
-	
-}
-
-int main(){
+#include <mpi.h>
+#include <omp.h>
+
+#include "headers/options.h"
+#include "headers/process.h"
+#include "headers/shared.h"
+#include "headers/workspace.h"
+#include "headers/helpers.h"
+#include "headers/mpihelp.h"
+#include "headers/distance.h"
+#include "headers/vptree.h"
+#include "headers/smp.h"
+#include "headers/stream.h"
+#include "headers/verify.h"
+
+// Relative error a kernel's distance may have from the double precision one.
+#define KERNEL_TOLERANCE 1e-5
+
+// What the building blocks time while they are checked, never reported.
+profile prof;
+
+
+int compareFloats(const void *a, const void *b) {
+    float x = *(const float *) a, y = *(const float *) b;
+    return (x > y) - (x < y);
+}
+
+
+// Prints the verdict of a check on the Master. Returns 1 if any process failed it.
+int report(const char *name, bool ok) {
+    int rank, all = ok;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Allreduce(MPI_IN_PLACE, &all, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (rank == 0) {
+        printf("%-48s %s\n", name, (all) ? "ok" : "FAILED");
+    }
+    return !all;
+}
+
+
+// Where the group's split falls, as splitValue defines it, from a sorted copy of the
+// values of every process: the first half of the processes keeps as many as it holds.
+float referenceSplit(float *values, long n, MPI_Comm comm) {
+    int size;
+    MPI_Comm_size(comm, &size);
+    int count = n;
+    int *counts = (int *) malloc(size * sizeof(int));
+    int *displs = (int *) malloc(size * sizeof(int));
+    MPI_Allgather(&count, 1, MPI_INT, counts, 1, MPI_INT, comm);
+    long total = 0, k = 0;
+    for (int i = 0; i < size; i++) {
+        displs[i] = total;
+        total += counts[i];
+        if (i < size / 2) {
+            k += counts[i];
+        }
+    }
+
+    float *all = (float *) malloc(total * sizeof(float));
+    MPI_Allgatherv(values, count, MPI_FLOAT, all, counts, displs, MPI_FLOAT, comm);
+    qsort(all, total, sizeof(float), compareFloats);
+    float median = (k == 0) ? all[0] : (float) ((all[k - 1] + all[k]) / 2);
+
+    free(all);
+    free(counts);
+    free(displs);
+    return median;
+}
+
+
+/**
+ * The same split value with histograms, on enough distances to take a few rounds: plenty
+ * of ties, hardly any, and a skewed spread that crowds most of them in the first bins.
+ */
+int testHistogramMedian() {
+    options opt;
+    parse_options(0, NULL, &opt);
+    opt.select = SELECT_HISTOGRAM;
+
+    process p;
+    workspace ws;
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.pointsNum = 20000 + 7 * p.comm_rank;
+    p.opt = &opt;
+    p.ws = &ws;
+    p.prof = &prof;
+    p.world = MPI_COMM_WORLD;
+    workspace_init(&ws, &p);
+
+    float *distances = (float *) malloc(p.pointsNum * sizeof(float));
+    float *before = (float *) malloc(p.pointsNum * sizeof(float));
+    bool ok = true;
+    for (int spread = 0; spread < 3; spread++) {
+        for (long i = 0; i < p.pointsNum; i++) {
+            float u = (float) rand() / RAND_MAX;
+            distances[i] = (spread == 0) ? rand() % 20 : (spread == 1) ? u : powf(u, 8);
+        }
+        memcpy(before, distances, p.pointsNum * sizeof(float));
+
+        float median = histogramMedian(distances, MPI_COMM_WORLD, &p);
+        float reference = referenceSplit(distances, p.pointsNum, MPI_COMM_WORLD);
+        ok = ok && median == reference;
+        ok = ok && memcmp(before, distances, p.pointsNum * sizeof(float)) == 0;
+    }
+
+    free(distances);
+    free(before);
+    workspace_free(&ws);
+    return report("histogramMedian", ok);
+}
+
+
+// Whether a kernel's distance is close enough to the reference one.
+bool closeEnough(float d, double reference) {
+    return fabs(d - reference) <= KERNEL_TOLERANCE * reference + 1e-6;
+}
+
+
+// The first checks of kthSmallest, quickselect and maxPower, by hand.
+void printOldChecks() {
     //float* dist_array = malloc(10*sizeof(float));
     float dist_array[] = {3,1,2,1};
 
@@ -136,8 +167,801 @@ int main(){
     int test_pow = 69;
     int maxPow = maxPower(test_pow, 2, 0);
     printf("\nMax power of %d is %d\n", test_pow, maxPow);
+}
 
-    
+
+// Three way partition of a subarray full of ties, around a value that is in it and one that isn't.
+int testPartition3() {
+    long n = 1000, left = 100, right = 900;
+    float *a = (float *) malloc(n * sizeof(float));
+    float *before = (float *) malloc(n * sizeof(float));
+    float values[] = {2, 2.5};
+    bool ok = true;
+
+    for (int v = 0; v < 2; v++) {
+        for (long i = 0; i < n; i++) {
+            a[i] = rand() % 5;
+        }
+        memcpy(before, a, n * sizeof(float));
+
+        long lt, gt;
+        partition3(a, left, right, values[v], &lt, &gt);
+
+        ok = ok && left <= lt && lt <= gt && gt <= right;
+        for (long i = left; ok && i < right; i++) {
+            ok = (i < lt) ? a[i] < values[v] : (i < gt) ? a[i] == values[v] : a[i] > values[v];
+        }
+        // Nothing outside the subarray moves, and the subarray keeps the same values.
+        qsort(&a[left], right - left, sizeof(float), compareFloats);
+        qsort(&before[left], right - left, sizeof(float), compareFloats);
+        ok = ok && memcmp(a, before, n * sizeof(float)) == 0;
+    }
+
+    free(a);
+    free(before);
+    return report("partition3", ok);
+}
+
+
+/**
+ * The k-th smallest value and the one after it, against a sorted copy. The large
+ * populations go through the threads, the small one straight to kthSmallest. The
+ * last one has so many ties that the threads find the value themselves.
+ */
+int testParallelSelect() {
+    long sizes[] = {1000, 200000, 200000};
+    long ranges[] = {100, 20000, 4};
+    bool ok = true;
+
+    for (int s = 0; s < 3; s++) {
+        long n = sizes[s];
+        float *values = (float *) malloc(n * sizeof(float));
+        float *sorted = (float *) malloc(n * sizeof(float));
+        float *a = (float *) malloc(n * sizeof(float));
+        float *scratch = (float *) malloc(n * sizeof(float));
+        // Ties, as at the median of duplicated points.
+        for (long i = 0; i < n; i++) {
+            values[i] = rand() % ranges[s];
+        }
+        memcpy(sorted, values, n * sizeof(float));
+        qsort(sorted, n, sizeof(float), compareFloats);
+
+        long ks[] = {0, n / 2 - 1, n / 2, n - 2};
+        for (int i = 0; i < 4; i++) {
+            memcpy(a, values, n * sizeof(float));
+            float next;
+            float value = parallelSelect(a, n, ks[i], scratch, &next);
+            ok = ok && value == sorted[ks[i]] && next == sorted[ks[i] + 1];
+        }
+
+        free(values);
+        free(sorted);
+        free(a);
+        free(scratch);
+    }
+
+    return report("parallelSelect", ok);
+}
+
+
+/**
+ * The split value of an uneven number of distances per process, once with plenty of ties
+ * and once with hardly any, against the one of all of them sorted. The distances
+ * themselves must not move.
+ */
+int testDistributedMedian() {
+    options opt;
+    parse_options(0, NULL, &opt);
+    opt.select = SELECT_DISTRIBUTED;
+
+    process p;
+    workspace ws;
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.pointsNum = 1000 + 7 * p.comm_rank;
+    p.opt = &opt;
+    p.ws = &ws;
+    p.prof = &prof;
+    p.world = MPI_COMM_WORLD;
+    workspace_init(&ws, &p);
+
+    float *distances = (float *) malloc(p.pointsNum * sizeof(float));
+    float *before = (float *) malloc(p.pointsNum * sizeof(float));
+    bool ok = true;
+    for (int ties = 0; ties < 2; ties++) {
+        for (long i = 0; i < p.pointsNum; i++) {
+            distances[i] = (ties) ? rand() % 20 : (float) rand() / RAND_MAX;
+        }
+        memcpy(before, distances, p.pointsNum * sizeof(float));
+
+        float median = distributedMedian(distances, MPI_COMM_WORLD, &p);
+        float reference = referenceSplit(distances, p.pointsNum, MPI_COMM_WORLD);
+        ok = ok && median == reference;
+        ok = ok && memcmp(before, distances, p.pointsNum * sizeof(float)) == 0;
+    }
+
+    free(distances);
+    free(before);
+    workspace_free(&ws);
+    return report("distributedMedian", ok);
+}
+
+
+/**
+ * The kernel distance.c picked for this CPU, against a plain loop in double precision.
+ * Every size but 16 leaves a tail after the last full vector.
+ */
+int testKernels() {
+    long sizes[] = {1, 7, 16, 33, 100, 784};
+    long n = 50;
+    bool ok = true;
+
+    for (int s = 0; s < 6; s++) {
+        long dims = sizes[s];
+        float *points = (float *) malloc(n * dims * sizeof(float));
+        float *out = (float *) malloc(n * sizeof(float));
+        for (long i = 0; i < n * dims; i++) {
+            points[i] = 2 * (float) rand() / RAND_MAX - 1;
+        }
+
+        // The pivot is the first point.
+        distancesBatch(points, n, dims, points, out);
+        for (long i = 0; i < n; i++) {
+            double reference = 0;
+            for (long j = 0; j < dims; j++) {
+                double d = (double) points[i * dims + j] - points[j];
+                reference += d * d;
+            }
+            ok = ok && closeEnough(out[i], reference);
+        }
+
+        free(points);
+        free(out);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "distancesBatch (%s)", distanceKernelName());
+    return report(name, ok);
+}
+
+
+/**
+ * The tile kernels have to give exactly the distances of the row kernels, on either
+ * side of every width the row kernels step by. 50 points leave a padded last tile,
+ * and every point has to come out of its tile as it went in.
+ */
+int testTiledKernels() {
+    long sizes[] = {1, 7, 8, 9, 16, 17, 31, 32, 33, 47, 100, 784};
+    long n = 50;
+    bool ok = true;
+
+    for (int s = 0; s < 12; s++) {
+        long dims = sizes[s];
+        float *points = (float *) malloc(n * dims * sizeof(float));
+        float *tiles = (float *) malloc(tiledFloats(n, dims) * sizeof(float));
+        float *rows = (float *) malloc(n * sizeof(float));
+        float *tiled = (float *) malloc(n * sizeof(float));
+        float *point = (float *) malloc(dims * sizeof(float));
+        for (long i = 0; i < n * dims; i++) {
+            points[i] = 2 * (float) rand() / RAND_MAX - 1;
+        }
+
+        tilePoints(points, n, dims, tiles);
+        distancesBatch(points, n, dims, &points[3 * dims], rows);
+        distancesTiled(tiles, n, dims, &points[3 * dims], tiled);
+        ok = ok && memcmp(rows, tiled, n * sizeof(float)) == 0;
+        for (long i = 0; i < n; i++) {
+            untilePoint(tiles, i, dims, point);
+            ok = ok && memcmp(point, &points[i * dims], dims * sizeof(float)) == 0;
+        }
+
+        free(points);
+        free(tiles);
+        free(rows);
+        free(tiled);
+        free(point);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "distancesTiled (%s)", distanceKernelName());
+    return report(name, ok);
+}
+
+
+/**
+ * The uint8 and fp16 kernels against plain loops over the decoded values. The points
+ * are stored a few values apart, like the padded points of compact_points.
+ */
+int testCompactKernels() {
+    long sizes[] = {1, 7, 16, 33, 100, 784};
+    long n = 50;
+    float scale2 = 0.25;
+    bool ok[2] = {true, true};
+
+    for (int s = 0; s < 6; s++) {
+        long dims = sizes[s];
+        long stride = dims + 3;
+        unsigned char *bytes = (unsigned char *) malloc(n * stride);
+        unsigned short *halves = (unsigned short *) malloc(n * stride * sizeof(unsigned short));
+        float *out = (float *) malloc(n * sizeof(float));
+        for (long i = 0; i < n * stride; i++) {
+            bytes[i] = rand() % 256;
+            halves[i] = floatToHalf((float) rand() / RAND_MAX);
+        }
+
+        // The pivot is the first point of each set.
+        distancesBatchU8(bytes, n, stride, dims, bytes, scale2, out);
+        for (long i = 0; i < n; i++) {
+            double reference = 0;
+            for (long j = 0; j < dims; j++) {
+                double d = (double) bytes[i * stride + j] - bytes[j];
+                reference += d * d;
+            }
+            ok[0] = ok[0] && closeEnough(out[i], reference * scale2);
+        }
+
+        distancesBatchF16(halves, n, stride, dims, halves, scale2, out);
+        for (long i = 0; i < n; i++) {
+            double reference = 0;
+            for (long j = 0; j < dims; j++) {
+                double d = (double) halfToFloat(halves[i * stride + j]) - halfToFloat(halves[j]);
+                reference += d * d;
+            }
+            ok[1] = ok[1] && closeEnough(out[i], reference * scale2);
+        }
+
+        free(bytes);
+        free(halves);
+        free(out);
+    }
+
+    return report("distancesBatchU8", ok[0]) + report("distancesBatchF16", ok[1]);
+}
+
+
+// Chunk j has to end up holding what chunk perm[j] held, whatever cycles the permutation has.
+int testPermuteChunks() {
+    long n = 500, len = 3;
+    float *array = (float *) malloc(n * len * sizeof(float));
+    float *temp = (float *) malloc(len * sizeof(float));
+    long *perm = (long *) malloc(n * sizeof(long));
+    long *expected = (long *) malloc(n * sizeof(long));
+
+    // A random permutation, chunk i holding i in every value.
+    for (long i = 0; i < n; i++) {
+        perm[i] = i;
+        for (long j = 0; j < len; j++) {
+            array[i * len + j] = i;
+        }
+    }
+    for (long i = n - 1; i > 0; i--) {
+        long j = rand() % (i + 1);
+        long t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+    }
+    memcpy(expected, perm, n * sizeof(long));
+
+    permuteChunks(array, perm, n, len, temp);
+    bool ok = true;
+    for (long i = 0; i < n * len; i++) {
+        ok = ok && array[i] == expected[i / len];
+    }
+
+    free(array);
+    free(temp);
+    free(perm);
+    free(expected);
+    return report("permuteChunks", ok);
+}
+
+
+/**
+ * The wanted points first, then the unwanted ones and the medians last, for a process
+ * of either half. Every point holds its distance in its first value, so it has to
+ * end up next to it.
+ */
+bool checkSortByMedian(int *(*sort)(float *, float *, float, process *), options *opt) {
+    long dims = 3;
+
+    // The workspace is the world's, the check then plays both halves of a group of two.
+    process p;
+    workspace ws;
+    point_format format = {FORMAT_FLOAT, dims, 1, 0, false};
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.dims = dims;
+    p.pointsNum = 1000;
+    p.opt = opt;
+    p.ws = &ws;
+    p.prof = &prof;
+    p.format = &format;
+    p.world = MPI_COMM_WORLD;
+    workspace_init(&ws, &p);
+    p.comm_size = 2;
+
+    float *array = (float *) malloc(p.pointsNum * sizeof(float));
+    float *points = (float *) malloc(p.pointsNum * dims * sizeof(float));
+    float median = 10;
+    bool ok = true;
+    for (p.comm_rank = 0; p.comm_rank < 2; p.comm_rank++) {
+        long counts[3] = {0, 0, 0};
+        for (long i = 0; i < p.pointsNum; i++) {
+            array[i] = rand() % 21;
+            for (long j = 0; j < dims; j++) {
+                points[i * dims + j] = array[i];
+            }
+            // 0 for the points the process keeps, 1 for the ones it gives away, 2 for medians.
+            int c = (array[i] == median) ? 2 : ((array[i] < median) == (p.comm_rank == 0)) ? 0 : 1;
+            counts[c]++;
+        }
+
+        int *result = sort(array, points, median, &p);
+        ok = ok && result[0] == counts[1] + counts[2] && result[1] == counts[2];
+        ok = ok && result[2] == ((counts[2]) ? counts[0] : -1);
+        for (long i = 0; ok && i < p.pointsNum; i++) {
+            int c = (array[i] == median) ? 2 : ((array[i] < median) == (p.comm_rank == 0)) ? 0 : 1;
+            ok = c == ((i < counts[0]) ? 0 : (i < counts[0] + counts[1]) ? 1 : 2);
+            for (long j = 0; j < dims; j++) {
+                ok = ok && points[i * dims + j] == array[i];
+            }
+        }
+    }
+
+    free(array);
+    free(points);
+    workspace_free(&ws);
+    return ok;
+}
+
+
+int testSortByMedianIndexed() {
+    options opt;
+    parse_options(0, NULL, &opt);
+    opt.partition = PARTITION_INDEX;
+
+    return report("sortByMedianIndexed", checkSortByMedian(sortByMedianIndexed, &opt));
+}
+
+
+// The in place partition of the threads, on more threads than the sandbox may have cores.
+int testSortByMedianParallel() {
+    options opt;
+    parse_options(0, NULL, &opt);
+    opt.threads = 4;
+
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(opt.threads);
+    bool ok = checkSortByMedian(sortByMedianParallel, &opt);
+    omp_set_num_threads(threads);
+
+    return report("sortByMedianParallel", ok);
+}
+
+
+/**
+ * One all-to-all level of the whole world: afterwards no process may keep a point
+ * of the other half, other than a median, and the world must hold the same points.
+ * Every point holds its distance in its first value, the distances have to move along.
+ */
+int testAlltoallExchange() {
+    long dims = 2;
+    options opt;
+    parse_options(0, NULL, &opt);
+    opt.partition = PARTITION_INDEX;
+    opt.exchange = EXCHANGE_ALLTOALL;
+    point_format format = {FORMAT_FLOAT, dims, 1, 0};
+
+    process p;
+    workspace ws;
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.dims = dims;
+    p.pointsNum = 500;
+    p.opt = &opt;
+    p.ws = &ws;
+    p.prof = &prof;
+    p.world = MPI_COMM_WORLD;
+    p.format = &format;
+    workspace_init(&ws, &p);
+
+    float *distances = (float *) malloc(p.pointsNum * sizeof(float));
+    float *points = (float *) malloc(p.pointsNum * dims * sizeof(float));
+    for (long i = 0; i < p.pointsNum; i++) {
+        distances[i] = rand() % 20;
+        points[i * dims] = distances[i];
+        points[i * dims + 1] = p.comm_rank * p.pointsNum + i;
+    }
+    float median = referenceSplit(distances, p.pointsNum, MPI_COMM_WORLD);
+    double sums[2] = {0, 0}, sumsAfter[2] = {0, 0};
+    for (long i = 0; i < p.pointsNum * dims; i++) {
+        sums[i % dims] += points[i];
+    }
+
+    int *sorted = sortByMedian(distances, points, median, &p);
+    splitTies(sorted, points, distances, median, ws.unwantedMat, MPI_COMM_WORLD, &p);
+
+    groupTopology(MPI_COMM_WORLD, &p);
+    alltoallExchange(ws.unwantedMat, points, distances, MPI_COMM_WORLD, &p);
+
+    bool left_half = p.comm_rank < p.comm_size / 2;
+    bool ok = true;
+    for (long i = 0; i < p.pointsNum; i++) {
+        float d = points[i * dims];
+        ok = ok && (d == median || (d < median) == left_half) && distances[i] == d;
+    }
+    for (long i = 0; i < p.pointsNum * dims; i++) {
+        sumsAfter[i % dims] += points[i];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, sums, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, sumsAfter, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    ok = ok && sums[0] == sumsAfter[0] && sums[1] == sumsAfter[1];
+
+    free(distances);
+    free(points);
+    workspace_free(&ws);
+    return report("alltoallExchange", ok);
+}
+
+
+/**
+ * A world of distances that are almost all ties, split at its split value: both halves
+ * have to send as many points as they get, every process must send only points of the
+ * other half or medians, and keep only points of its own half or medians.
+ */
+int testSplitTies() {
+    long dims = 2;
+    options opt;
+    parse_options(0, NULL, &opt);
+    point_format format = {FORMAT_FLOAT, dims, 1, 0};
+
+    process p;
+    workspace ws;
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.dims = dims;
+    p.pointsNum = 1000 + 7 * p.comm_rank;
+    p.opt = &opt;
+    p.ws = &ws;
+    p.prof = &prof;
+    p.format = &format;
+    p.world = MPI_COMM_WORLD;
+    workspace_init(&ws, &p);
+
+    float *distances = (float *) malloc(p.pointsNum * sizeof(float));
+    float *points = (float *) malloc(p.pointsNum * dims * sizeof(float));
+    for (long i = 0; i < p.pointsNum; i++) {
+        distances[i] = rand() % 3;
+        points[i * dims] = distances[i];
+        points[i * dims + 1] = i;
+    }
+    float median = referenceSplit(distances, p.pointsNum, MPI_COMM_WORLD);
+
+    int *sorted = sortByMedian(distances, points, median, &p);
+    splitTies(sorted, points, distances, median, ws.unwantedMat, MPI_COMM_WORLD, &p);
+
+    long sent[2] = {0, 0};
+    for (int i = 0; i < p.comm_size; i++) {
+        sent[i >= p.comm_size / 2] += ws.unwantedMat[i];
+    }
+    bool ok = sent[0] == sent[1];
+
+    bool left_half = p.comm_rank < p.comm_size / 2;
+    long keep = p.pointsNum - ws.unwantedMat[p.comm_rank];
+    for (long i = 0; i < p.pointsNum; i++) {
+        float d = distances[i];
+        bool mine = d == median || (d < median) == left_half;
+        bool theirs = d == median || (d < median) != left_half;
+        ok = ok && ((i < keep) ? mine : theirs) && points[i * dims] == d;
+    }
+
+    free(distances);
+    free(points);
+    workspace_free(&ws);
+    return report("splitTies", ok);
+}
+
+
+/**
+ * Every process asks for a scattered set of the points of a small file, in no
+ * particular order, and has to find exactly those points in its own output file.
+ * Point j of the file is (j, 2j, -j), so the points tell where they came from.
+ */
+int testStreamWrite() {
+    long features = 3;
+    char *input = "test_stream.bin", *prefix = "test_stream_out";
+    options opt;
+    parse_options(0, NULL, &opt);
+    point_format format = {FORMAT_RECORD, features, 1, 0};
+
+    process p;
+    workspace ws;
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.dims = STREAM_RECORD_FLOATS;
+    p.pointsNum = 100 + 7 * p.comm_rank;
+    p.opt = &opt;
+    p.ws = &ws;
+    p.prof = &prof;
+    p.world = MPI_COMM_WORLD;
+    p.format = &format;
+    workspace_init(&ws, &p);
+
+    long total = ws.worldOffsets[p.comm_size - 1] + ws.worldCounts[p.comm_size - 1];
+    if (p.comm_rank == 0) {
+        FILE *fp = fopen(input, "wb");
+        fwrite(&features, sizeof(long), 1, fp);
+        fwrite(&total, sizeof(long), 1, fp);
+        for (long j = 0; j < total; j++) {
+            float point[3] = {j, 2 * j, -j};
+            fwrite(point, sizeof(float), features, fp);
+        }
+        fclose(fp);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    // Point j goes to process j * 7 % size, the records listed from the last one.
+    stream_record *records = (stream_record *) malloc(total * sizeof(stream_record));
+    long n = 0;
+    for (long j = total - 1; j >= 0; j--) {
+        if (j * 7 % p.comm_size != p.comm_rank) {
+            continue;
+        }
+        int origin = 0;
+        while (j >= ws.worldOffsets[origin] + ws.worldCounts[origin]) {
+            origin++;
+        }
+        records[n].dist = 0;
+        records[n].origin = origin;
+        records[n].offset = j - ws.worldOffsets[origin];
+        n++;
+    }
+    p.pointsNum = n;
+
+    MPI_File fh;
+    MPI_File_open(MPI_COMM_WORLD, input, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+    stream_write(fh, (float *) records, prefix, &p);
+    MPI_File_close(&fh);
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "%s%d.bin", prefix, p.comm_rank);
+    FILE *fp = fopen(filename, "rb");
+    long header[2] = {0, 0};
+    bool ok = fp != NULL && fread(header, sizeof(long), 2, fp) == 2;
+    ok = ok && header[0] == features && header[1] == n;
+    float *points = (float *) malloc(n * features * sizeof(float));
+    bool *seen = (bool *) calloc(total, sizeof(bool));
+    ok = ok && fread(points, sizeof(float), n * features, fp) == (size_t) (n * features);
+    for (long i = 0; ok && i < n; i++) {
+        long j = points[i * features];
+        ok = j >= 0 && j < total && j * 7 % p.comm_size == p.comm_rank && !seen[j];
+        ok = ok && points[i * features + 1] == 2 * j && points[i * features + 2] == -j;
+        seen[j] = true;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    remove(filename);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (p.comm_rank == 0) {
+        remove(input);
+    }
+
+    free(records);
+    free(points);
+    free(seen);
+    workspace_free(&ws);
+    return report("stream_write", ok);
+}
+
+
+/**
+ * The checksum has to ignore where the points are, and notice a point that changed
+ * or was replaced by a copy of another one. The order check has to notice a single
+ * distance of a process below the largest one of the process before it.
+ */
+int testVerify() {
+    long dims = 5;
+    process p;
+    memset(&p, 0, sizeof(process));
+    MPI_Comm_rank(MPI_COMM_WORLD, &p.comm_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &p.comm_size);
+    p.dims = dims;
+    p.pointsNum = 1000 + 7 * p.comm_rank;
+
+    float *points = (float *) malloc(p.pointsNum * dims * sizeof(float));
+    float *temp = (float *) malloc(dims * sizeof(float));
+    float *distances = (float *) malloc(p.pointsNum * sizeof(float));
+    for (long i = 0; i < p.pointsNum * dims; i++) {
+        points[i] = (float) rand() / RAND_MAX;
+    }
+
+    long count[4];
+    uint64_t checksum[4];
+    verify_checksum(points, &p, &count[0], &checksum[0]);
+
+    // Shuffle the points of every process.
+    for (long i = p.pointsNum - 1; i > 0; i--) {
+        long j = rand() % (i + 1);
+        memcpy(temp, &points[i * dims], dims * sizeof(float));
+        memcpy(&points[i * dims], &points[j * dims], dims * sizeof(float));
+        memcpy(&points[j * dims], temp, dims * sizeof(float));
+    }
+    verify_checksum(points, &p, &count[1], &checksum[1]);
+
+    // Only the Master changes a point, then replaces it with a copy of another one.
+    if (p.comm_rank == 0) {
+        points[3 * dims + 1] += 1;
+    }
+    verify_checksum(points, &p, &count[2], &checksum[2]);
+    if (p.comm_rank == 0) {
+        memcpy(&points[3 * dims], &points[4 * dims], dims * sizeof(float));
+    }
+    verify_checksum(points, &p, &count[3], &checksum[3]);
+
+    bool ok = count[1] == count[0] && checksum[1] == checksum[0];
+    ok = ok && checksum[2] != checksum[0];
+    ok = ok && count[3] == count[0] && checksum[3] != checksum[0] && checksum[3] != checksum[2];
+
+    // Process r holds distances in [r, r + 1), unsorted.
+    for (long i = 0; i < p.pointsNum; i++) {
+        distances[i] = p.comm_rank + (float) rand() / RAND_MAX;
+    }
+    bool inOrder = verify_order(distances, &p);
+    if (p.comm_rank == p.comm_size - 1) {
+        distances[p.pointsNum / 2] = p.comm_rank - 0.5;
+    }
+    bool outOfOrder = !verify_order(distances, &p);
+    ok = ok && inOrder && outOfOrder;
+
+    free(points);
+    free(temp);
+    free(distances);
+    return report("verify_checksum and verify_order", ok);
+}
+
+
+/**
+ * The k nearest neighbours the local tree finds, against the distances to every
+ * point sorted. The indices have to point at the reordered points at that distance,
+ * and the index each of them carries at the point it was before the build.
+ */
+int testVptreeSearch() {
+    long dims = 4, n = 3000;
+    int k = 7;
+    vp_tree t;
+    vptree_init(&t, dims);
+    long stride = t.stride;
+
+    float *original = (float *) malloc(n * dims * sizeof(float));
+    float *points = (float *) malloc(n * stride * sizeof(float));
+    float *query = (float *) malloc(dims * sizeof(float));
+    float *all = (float *) malloc(n * sizeof(float));
+    float *bestDist = (float *) malloc(k * sizeof(float));
+    long *bestIndex = (long *) malloc(k * sizeof(long));
+    for (long i = 0; i < n * dims; i++) {
+        original[i] = rand() % 50;
+    }
+    for (long i = 0; i < n; i++) {
+        memcpy(&points[i * stride], &original[i * dims], dims * sizeof(float));
+        memcpy(&points[i * stride + dims], &i, sizeof(long));
+    }
+    vptree_build_local(&t, points, n);
+
+    bool ok = true;
+    for (int q = 0; q < 20; q++) {
+        for (long j = 0; j < dims; j++) {
+            query[j] = (float) rand() / RAND_MAX * 50;
+        }
+        for (long i = 0; i < n; i++) {
+            all[i] = sqrtf(distanceSquared(query, &original[i * dims], dims));
+        }
+        qsort(all, n, sizeof(float), compareFloats);
+
+        int found = vptree_search_local(&t, query, k, INFINITY, bestDist, bestIndex);
+        ok = ok && found == k;
+        for (int i = 0; ok && i < k; i++) {
+            ok = bestDist[i] == all[i];
+            ok = ok && bestDist[i] == sqrtf(distanceSquared(query, &points[bestIndex[i] * stride], dims));
+            long index = vptree_index(&t, bestIndex[i]);
+            ok = ok && index >= 0 && index < n && memcmp(&original[index * dims], &points[bestIndex[i] * stride], dims * sizeof(float)) == 0;
+        }
+    }
+
+    vptree_free(&t);
+    free(original);
+    free(points);
+    free(query);
+    free(all);
+    free(bestDist);
+    free(bestIndex);
+    return report("vptree_search_local", ok);
+}
+
+
+/**
+ * The engine of linear.c on an uneven number of parts, large enough for the threads
+ * to split the top ranges: every part must hold exactly the distances a sorted copy
+ * has in its range, and every point has to move along with its distance.
+ */
+int testSmpDistribute() {
+    long dims = 2, n = 100003;
+    int parts = 7;
+    float *points = (float *) malloc(n * dims * sizeof(float));
+    float *distances = (float *) malloc(n * sizeof(float));
+    float *sorted = (float *) malloc(n * sizeof(float));
+    double ids = 0;
+    for (long i = 0; i < n; i++) {
+        distances[i] = rand() % 1000;
+        points[i * dims] = distances[i];
+        points[i * dims + 1] = i;
+        ids += i;
+    }
+    memcpy(sorted, distances, n * sizeof(float));
+    qsort(sorted, n, sizeof(float), compareFloats);
+
+    smp_engine e;
+    smp_init(&e, points, distances, dims, n, parts);
+    smp_distribute(&e);
+
+    bool ok = smp_check(&e);
+    double idsAfter = 0;
+    for (long i = 0; i < n; i++) {
+        ok = ok && points[i * dims] == distances[i];
+        idsAfter += points[i * dims + 1];
+    }
+    ok = ok && idsAfter == ids;
+    for (int i = 0; i < parts; i++) {
+        long count, offset;
+        rankChunk(n, parts, i, &count, &offset);
+        qsort(&distances[offset], count, sizeof(float), compareFloats);
+        ok = ok && memcmp(&distances[offset], &sorted[offset], count * sizeof(float)) == 0;
+    }
+
+    smp_free(&e);
+    free(points);
+    free(distances);
+    free(sorted);
+    return report("smp_distribute", ok);
 }
 
 
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    srand(rank + 1);
+    profile_init(&prof);
+
+    if (rank == 0) {
+        printOldChecks();
+        printf("\n\n");
+    }
+
+    int failed = 0;
+    failed += testPartition3();
+    failed += testParallelSelect();
+    failed += testDistributedMedian();
+    failed += testHistogramMedian();
+    failed += testKernels();
+    failed += testCompactKernels();
+    failed += testTiledKernels();
+    failed += testPermuteChunks();
+    failed += testSortByMedianIndexed();
+    failed += testSortByMedianParallel();
+    failed += testAlltoallExchange();
+    failed += testSplitTies();
+    failed += testStreamWrite();
+    failed += testVerify();
+    failed += testVptreeSearch();
+    failed += testSmpDistribute();
+
+    if (rank == 0) {
+        printf("\n%s\n", (failed) ? "SOME CHECKS FAILED." : "ALL CHECKS PASSED.");
+    }
+    MPI_Finalize();
+    return failed != 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file: verify.c
+ * ********************
+ * @description: Self-check of a run, over MPI_COMM_WORLD. Nothing is gathered on the
+ * Master and the distances are only read, so the check can run after every partition.
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <float.h>
+#include <mpi.h>
+
+#include "headers/verify.h"
+#include "headers/rng.h"
+
+
+/**
+ * Whether every distance of every process is at most every distance of the next one.
+ * Each process finds its minimum and maximum in one pass, sends its minimum to the
+ * process before it and compares its maximum with the minimum of the one after it.
+ * The verdict of every process is combined with MPI_LAND.
+ */
+bool verify_order(float *distances, process *p) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    float lowest = FLT_MAX, highest = -FLT_MAX;
+    #pragma omp parallel for reduction(min:lowest) reduction(max:highest) schedule(static)
+    for (long i = 0; i < p->pointsNum; i++) {
+        lowest = (distances[i] < lowest) ? distances[i] : lowest;
+        highest = (distances[i] > highest) ? distances[i] : highest;
+    }
+
+    // The last process has nobody after it, and keeps FLT_MAX.
+    float nextMin = FLT_MAX;
+    MPI_Sendrecv(&lowest, 1, MPI_FLOAT, (rank > 0) ? rank - 1 : MPI_PROC_NULL, 120,
+        &nextMin, 1, MPI_FLOAT, (rank < size - 1) ? rank + 1 : MPI_PROC_NULL, 120, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    int inOrder = highest <= nextMin;
+    MPI_Allreduce(MPI_IN_PLACE, &inOrder, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    return inOrder;
+}
+
+
+/**
+ * The number of points of the world and the sum of their hashes, which only depends
+ * on which points there are, not on where they are. Every point is hashed as the
+ * p->dims words it is stored in, with FNV-1a, and mixed once more with splitmix64.
+ */
+void verify_checksum(float *points, process *p, long *count, uint64_t *checksum) {
+    const uint32_t *words = (const uint32_t *) points;
+    uint64_t sum = 0;
+
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for (long i = 0; i < p->pointsNum; i++) {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (long j = 0; j < p->dims; j++) {
+            hash = (hash ^ words[i * p->dims + j]) * 0x100000001B3ULL;
+        }
+        rng r;
+        rng_seed(&r, hash);
+        sum += rng_next(&r);
+    }
+
+    *count = p->pointsNum;
+    MPI_Allreduce(MPI_IN_PLACE, count, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&sum, checksum, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+}
@@ -0,0 +1,398 @@
+/**
+ * @file: vptree.c
+ * ********************
+ * @description: The parts of the vantage point tree outside the distributed splits:
+ * recording them, building the local tree, writing it out and searching the trees
+ * of every process.
+ * Distances are the squared ones of distance.c, radii are real distances, so that
+ * the triangle inequality holds when pruning.
+ * ********************
+ * File layout, all of it in native byte order:
+ * long dims, long levels, long nodesNum, long pointsNum,
+ * float pathRadii[levels], char pathInside[levels], float pathPivots[levels * dims],
+ * vp_node nodes[nodesNum], float points[pointsNum * (dims + VP_ID_FLOATS)], every
+ * point being its dims coordinates followed by its long index in the dataset.
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "headers/vptree.h"
+#include "headers/distance.h"
+#include "headers/helpers.h"
+
+// A distance along with the index of the point it belongs to.
+typedef struct {
+    float dist;
+    long index;
+} vp_pair;
+
+#define SWAP_PAIR(x, y) { vp_pair temp = x; x = y; y = temp; }
+
+
+void vptree_init(vp_tree *t, long dims) {
+    t->dims = dims;
+    t->stride = dims + VP_ID_FLOATS;
+    t->levels = 0;
+    t->pathPivots = (float *) malloc(VP_MAX_LEVELS * dims * sizeof(float));
+    t->pathRadii = (float *) malloc(VP_MAX_LEVELS * sizeof(float));
+    t->pathInside = (bool *) malloc(VP_MAX_LEVELS * sizeof(bool));
+
+    t->pointsNum = 0;
+    t->points = NULL;
+    t->nodes = NULL;
+    t->nodesNum = 0;
+    t->nodesCap = 0;
+
+    t->k = 0;
+    t->localDist = NULL;
+    t->localIndex = NULL;
+    t->allDist = NULL;
+    t->allIndex = NULL;
+    t->heads = NULL;
+}
+
+
+void vptree_free(vp_tree *t) {
+    free(t->pathPivots);
+    free(t->pathRadii);
+    free(t->pathInside);
+    free(t->nodes);
+    free(t->localDist);
+    free(t->localIndex);
+    free(t->allDist);
+    free(t->allIndex);
+    free(t->heads);
+}
+
+
+// Keeps the pivot and the radius of a split of the group, the median being a squared distance.
+void vptree_record_level(vp_tree *t, float *pivot, float median, bool inside) {
+    if (t->levels == VP_MAX_LEVELS) {
+        return;
+    }
+
+    memcpy(&t->pathPivots[t->levels * t->dims], pivot, t->dims * sizeof(float));
+    t->pathRadii[t->levels] = sqrtf(median);
+    t->pathInside[t->levels] = inside;
+    t->levels++;
+}
+
+
+// Places the k-th smallest pair at a[k], smaller ones before it and larger ones after.
+static void selectPair(vp_pair *a, long left, long right, long k) {
+    while (left < right) {
+        long pIndex = left + selectionRandom(right - left + 1);
+        float pivot = a[pIndex].dist;
+        SWAP_PAIR(a[pIndex], a[right]);
+
+        pIndex = left;
+        for (long i = left; i < right; i++) {
+            if (a[i].dist <= pivot) {
+                SWAP_PAIR(a[i], a[pIndex]);
+                pIndex++;
+            }
+        }
+        SWAP_PAIR(a[pIndex], a[right]);
+
+        if (k == pIndex) {
+            return;
+        } else if (k < pIndex) {
+            right = pIndex - 1;
+        } else {
+            left = pIndex + 1;
+        }
+    }
+}
+
+
+static long newNode(vp_tree *t) {
+    if (t->nodesNum == t->nodesCap) {
+        t->nodesCap = (t->nodesCap) ? 2 * t->nodesCap : 64;
+        t->nodes = (vp_node *) realloc(t->nodes, t->nodesCap * sizeof(vp_node));
+    }
+
+    return t->nodesNum++;
+}
+
+
+/**
+ * Builds the subtree of the points [start, end) and returns its node.
+ * The first point of the range is the vantage point. The rest are ordered by
+ * their distance from it, the closer half first.
+ * @param pairs, perm, row: scratch space for pointsNum pairs and indices and a point.
+ */
+static long buildNode(vp_tree *t, long start, long end, vp_pair *pairs, long *perm, float *dists, float *row) {
+    long node = newNode(t);
+    t->nodes[node].start = start;
+    t->nodes[node].end = end;
+    t->nodes[node].inside = -1;
+    t->nodes[node].outside = -1;
+
+    if (end - start <= VP_LEAF_SIZE) {
+        t->nodes[node].leaf = true;
+        t->nodes[node].mid = end;
+        t->nodes[node].radius = 0;
+        return node;
+    }
+
+    long stride = t->stride;
+    long base = start + 1;
+    long count = end - base;
+    distancesBatchStrided(&t->points[base * stride], count, stride, t->dims, &t->points[start * stride], dists);
+    for (long i = 0; i < count; i++) {
+        pairs[i].dist = dists[i];
+        pairs[i].index = i;
+    }
+
+    // The first point outside the radius sits right after the closer half.
+    long half = count / 2;
+    selectPair(pairs, 0, count - 1, half);
+    for (long i = 0; i < count; i++) {
+        perm[i] = pairs[i].index;
+    }
+    permuteChunks(&t->points[base * stride], perm, count, stride, row);
+
+    float radius = sqrtf(pairs[half].dist);
+    long mid = base + half;
+
+    long inside = (half > 0) ? buildNode(t, base, mid, pairs, perm, dists, row) : -1;
+    long outside = buildNode(t, mid, end, pairs, perm, dists, row);
+
+    // The array may have moved while building the children.
+    t->nodes[node].leaf = false;
+    t->nodes[node].mid = mid;
+    t->nodes[node].radius = radius;
+    t->nodes[node].inside = inside;
+    t->nodes[node].outside = outside;
+
+    return node;
+}
+
+
+// Builds the local tree over the points of the process, stride floats each, reordering them in place.
+void vptree_build_local(vp_tree *t, float *points, long pointsNum) {
+    t->points = points;
+    t->pointsNum = pointsNum;
+    t->nodesNum = 0;
+
+    if (pointsNum == 0) {
+        return;
+    }
+
+    vp_pair *pairs = (vp_pair *) malloc(pointsNum * sizeof(vp_pair));
+    long *perm = (long *) malloc(pointsNum * sizeof(long));
+    float *dists = (float *) malloc(pointsNum * sizeof(float));
+    float *row = (float *) malloc(t->stride * sizeof(float));
+
+    buildNode(t, 0, pointsNum, pairs, perm, dists, row);
+
+    free(pairs);
+    free(perm);
+    free(dists);
+    free(row);
+}
+
+
+// The index in the dataset of the i-th local point.
+long vptree_index(vp_tree *t, long i) {
+    long index;
+    memcpy(&index, &t->points[i * t->stride + t->dims], sizeof(long));
+    return index;
+}
+
+
+void vptree_write(vp_tree *t, char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        printf("Could not write %s.\n", filename);
+        return;
+    }
+
+    long header[4] = {t->dims, t->levels, t->nodesNum, t->pointsNum};
+    fwrite(header, sizeof(long), 4, fp);
+    fwrite(t->pathRadii, sizeof(float), t->levels, fp);
+    for (int i = 0; i < t->levels; i++) {
+        char inside = t->pathInside[i];
+        fwrite(&inside, 1, 1, fp);
+    }
+    fwrite(t->pathPivots, sizeof(float), t->levels * t->dims, fp);
+    fwrite(t->nodes, sizeof(vp_node), t->nodesNum, fp);
+    fwrite(t->points, sizeof(float), t->pointsNum * t->stride, fp);
+
+    fclose(fp);
+}
+
+
+/**
+ * The smallest distance any point of this process can have from the query,
+ * judging only by the splits of the groups it belonged to.
+ */
+float vptree_lower_bound(vp_tree *t, float *query) {
+    float bound = 0;
+
+    for (int i = 0; i < t->levels; i++) {
+        float d = sqrtf(distanceSquared(query, &t->pathPivots[i * t->dims], t->dims));
+        float gap = (t->pathInside[i]) ? d - t->pathRadii[i] : t->pathRadii[i] - d;
+        if (gap > bound) {
+            bound = gap;
+        }
+    }
+
+    return bound;
+}
+
+
+// Inserts a candidate in the sorted list of the best ones, if it is good enough.
+static void offer(float d, long index, int k, float *bestDist, long *bestIndex, int *found) {
+    if (*found == k && d >= bestDist[k - 1]) {
+        return;
+    }
+
+    int i = (*found < k) ? (*found)++ : k - 1;
+    while (i > 0 && bestDist[i - 1] > d) {
+        bestDist[i] = bestDist[i - 1];
+        bestIndex[i] = bestIndex[i - 1];
+        i--;
+    }
+    bestDist[i] = d;
+    bestIndex[i] = index;
+}
+
+
+static void searchNode(vp_tree *t, long node, float *query, int k, float bound,
+    float *bestDist, long *bestIndex, int *found)
+{
+    if (node < 0) {
+        return;
+    }
+    vp_node *n = &t->nodes[node];
+    long dims = t->dims, stride = t->stride;
+
+    if (n->leaf) {
+        for (long i = n->start; i < n->end; i++) {
+            offer(sqrtf(distanceSquared(query, &t->points[i * stride], dims)), i, k, bestDist, bestIndex, found);
+        }
+        return;
+    }
+
+    float d = sqrtf(distanceSquared(query, &t->points[n->start * stride], dims));
+    offer(d, n->start, k, bestDist, bestIndex, found);
+
+    float radius = n->radius;
+    long inside = n->inside, outside = n->outside;
+
+    // Visit the side the query falls in first, it is the likeliest to shrink tau.
+    for (int pass = 0; pass < 2; pass++) {
+        bool goInside = (d < radius) ? (pass == 0) : (pass == 1);
+        float tau = (*found == k && bestDist[k - 1] < bound) ? bestDist[k - 1] : bound;
+
+        if (goInside && d - tau <= radius) {
+            searchNode(t, inside, query, k, bound, bestDist, bestIndex, found);
+        } else if (!goInside && d + tau >= radius) {
+            searchNode(t, outside, query, k, bound, bestDist, bestIndex, found);
+        }
+    }
+}
+
+
+/**
+ * Finds the k local points closest to the query, ignoring anything further than bound.
+ * bestDist and bestIndex get the distances and the indices of the points in the
+ * reordered local points, closest first. Returns how many were found.
+ */
+int vptree_search_local(vp_tree *t, float *query, int k, float bound, float *bestDist, long *bestIndex) {
+    int found = 0;
+    if (t->nodesNum > 0) {
+        searchNode(t, 0, query, k, bound, bestDist, bestIndex, &found);
+    }
+
+    return found;
+}
+
+
+/**
+ * The k nearest neighbours of the query over the trees of every process.
+ * The processes whose partition may hold the query search first. The k-th distance
+ * they find bounds the rest, which only search if their partition comes closer than it.
+ * The master gets the merged results, closest first, and how many processes searched.
+ * @param bestDist, bestIndex: k entries each, on the master. The indices are the ones
+ * the points have in the dataset, -1 past the last neighbour if there are fewer than k points.
+ */
+int vptree_knn(vp_tree *t, float *query, int k, float *bestDist, long *bestIndex) {
+    int world_rank, world_size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    // The lists of every query are as long, so they are only allocated once.
+    if (t->k != k) {
+        t->k = k;
+        t->localDist = (float *) realloc(t->localDist, k * sizeof(float));
+        t->localIndex = (long *) realloc(t->localIndex, k * sizeof(long));
+        if (world_rank == 0) {
+            t->allDist = (float *) realloc(t->allDist, world_size * k * sizeof(float));
+            t->allIndex = (long *) realloc(t->allIndex, world_size * k * sizeof(long));
+            t->heads = (int *) realloc(t->heads, world_size * sizeof(int));
+        }
+    }
+    float *localDist = t->localDist;
+    long *localIndex = t->localIndex;
+    float *allDist = t->allDist;
+    long *allIndex = t->allIndex;
+
+    for (int i = 0; i < k; i++) {
+        localDist[i] = INFINITY;
+        localIndex[i] = -1;
+    }
+
+    float bound = vptree_lower_bound(t, query);
+    int searched = 0;
+
+    // At least one process has a zero bound, the one whose partition holds the query.
+    if (bound == 0) {
+        vptree_search_local(t, query, k, INFINITY, localDist, localIndex);
+        searched = 1;
+    }
+
+    float tau;
+    MPI_Allreduce(&localDist[k - 1], &tau, 1, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
+
+    if (bound > 0 && bound <= tau) {
+        vptree_search_local(t, query, k, tau, localDist, localIndex);
+        searched = 1;
+    }
+
+    // Positions among the reordered local points mean nothing to the master.
+    for (int i = 0; i < k && localIndex[i] != -1; i++) {
+        localIndex[i] = vptree_index(t, localIndex[i]);
+    }
+
+    MPI_Gather(localDist, k, MPI_FLOAT, allDist, k, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    MPI_Gather(localIndex, k, MPI_LONG, allIndex, k, MPI_LONG, 0, MPI_COMM_WORLD);
+
+    int totalSearched = 0;
+    MPI_Reduce(&searched, &totalSearched, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    // Each list is sorted already, so merge them by always taking the smallest head.
+    if (world_rank == 0) {
+        int *heads = t->heads;
+        memset(heads, 0, world_size * sizeof(int));
+        for (int i = 0; i < k; i++) {
+            int best = -1;
+            for (int r = 0; r < world_size; r++) {
+                if (heads[r] < k && (best == -1 || allDist[r * k + heads[r]] < allDist[best * k + heads[best]])) {
+                    best = r;
+                }
+            }
+            bestDist[i] = allDist[best * k + heads[best]];
+            bestIndex[i] = allIndex[best * k + heads[best]];
+            heads[best]++;
+        }
+    }
+
+    return totalSearched;
+}